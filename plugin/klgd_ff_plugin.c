@@ -3,123 +3,275 @@
 #include <linux/fixp-arith.h>
 #include <linux/jiffies.h>
 #include <linux/module.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
+#include <linux/ktime.h>
+#include <linux/timex.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#define CREATE_TRACE_POINTS
+#include "klgd_ff_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Michal \"MadCatX\" Maly");
 MODULE_DESCRIPTION("KLGD-FF Module");
 
 #define FRAC_16 15
-#define RECALC_DELTA_T_MSEC 20
+/* Precision of envelope slopes */
+#define FFPL_ENV_SLOPE_SHIFT 40
+/* Bounds of the recalculation interval derived from the error tolerance */
+#define FFPL_RECALC_MIN_NSEC (NSEC_PER_SEC / FFPL_UPDATE_RATE_MAX)
+#define FFPL_RECALC_MAX_NSEC NSEC_PER_SEC
+/* Steepest slope of the periodic waveforms per period relative to their magnitude, in thousandths */
+#define FFPL_SLOPE_SINE 6283	/* 2 * pi */
+#define FFPL_SLOPE_SAW 1000
+#define FFPL_SLOPE_TRIANGLE 2000
+/* Upload of a delayed effect is started this many times its expected duration ahead of the start */
+#define FFPL_PRELOAD_LEAD_FACTOR 4
+/* Quarter of the period of the waveform that emulates FF_RUMBLE, independent of the update rate */
+#define FFPL_RUMBLE_EMUL_QUARTER_NSEC (20 * NSEC_PER_MSEC)
 
 /* Combining handlers */
 #define FFPL_HANDLER_CF BIT(0)
 #define FFPL_HANDLER_RUMBLE BIT(1)
 #define FFPL_HANDLER_ANY (BIT(0) | BIT(1))
-/* Macros to set which combining handlers have to be called */
-#define NEEDS_UPDATE_SET(etype) \
+/* Macro to set which combining handlers have to be called */
+#define NEEDS_UPDATE_SET(cls) \
 	do { \
-		switch (etype) { \
-		case FF_CONSTANT: \
-		case FF_RAMP: \
+		if ((cls).combiner & FFPL_HANDLER_CF) \
 			needs_update_cf = true; \
-			break; \
-		case FF_RUMBLE: \
-			if (priv->memless_rumble_emul) \
-				needs_update_cf = true; \
-			else \
-				needs_update_rumble = true; \
-			break; \
-		case FF_PERIODIC: \
-			if (priv->memless_periodic_emul) \
-				needs_update_rumble = true; \
-			else \
-				needs_update_cf = true; \
-			break; \
-		default: \
-			break; \
-		} \
-	} while (0);
-
-#define ACTIVE_EFFECTS_INC(etype) \
-	do { \
-		switch (etype) { \
-		case FF_CONSTANT: \
-		case FF_RAMP: \
-			active_effects_cf++; \
-			break; \
-		case FF_RUMBLE: \
-			if (priv->memless_rumble_emul) \
-				active_effects_cf++; \
-			else \
-				active_effects_rumble++; \
-			break; \
-		case FF_PERIODIC: \
-			if (priv->memless_periodic_emul) \
-				active_effects_rumble++; \
-			else \
-				active_effects_cf++; \
-			break; \
-		default: \
-			break; \
-		} \
+		if ((cls).combiner & FFPL_HANDLER_RUMBLE) \
+			needs_update_rumble = true; \
 	} while (0);
 
 static int ffpl_handle_state_change(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff,
-				    const unsigned long now);
+				    const ktime_t now);
 static bool ffpl_needs_replacing(const struct ff_effect *ac_eff, const struct ff_effect *la_eff);
+static void ffpl_arm_trigger(struct klgd_plugin_private *priv, struct ffpl_effect *eff, const ktime_t now);
+
+/* First quarter of the sine wave in Q15, sampled at 256 intervals */
+static const s16 ffpl_sin_table[257] = {
+	0, 201, 402, 603, 804, 1005, 1206, 1407,
+	1608, 1809, 2009, 2210, 2410, 2611, 2811, 3012,
+	3212, 3412, 3612, 3811, 4011, 4210, 4410, 4609,
+	4808, 5007, 5205, 5404, 5602, 5800, 5998, 6195,
+	6393, 6590, 6786, 6983, 7179, 7375, 7571, 7767,
+	7962, 8157, 8351, 8545, 8739, 8933, 9126, 9319,
+	9512, 9704, 9896, 10087, 10278, 10469, 10659, 10849,
+	11039, 11228, 11417, 11605, 11793, 11980, 12167, 12353,
+	12539, 12725, 12910, 13094, 13279, 13462, 13645, 13828,
+	14010, 14191, 14372, 14553, 14732, 14912, 15090, 15269,
+	15446, 15623, 15800, 15976, 16151, 16325, 16499, 16673,
+	16846, 17018, 17189, 17360, 17530, 17700, 17869, 18037,
+	18204, 18371, 18537, 18703, 18868, 19032, 19195, 19357,
+	19519, 19680, 19841, 20000, 20159, 20317, 20475, 20631,
+	20787, 20942, 21096, 21250, 21403, 21554, 21705, 21856,
+	22005, 22154, 22301, 22448, 22594, 22739, 22884, 23027,
+	23170, 23311, 23452, 23592, 23731, 23870, 24007, 24143,
+	24279, 24413, 24547, 24680, 24811, 24942, 25072, 25201,
+	25329, 25456, 25582, 25708, 25832, 25955, 26077, 26198,
+	26319, 26438, 26556, 26674, 26790, 26905, 27019, 27133,
+	27245, 27356, 27466, 27575, 27683, 27790, 27896, 28001,
+	28105, 28208, 28310, 28411, 28510, 28609, 28706, 28803,
+	28898, 28992, 29085, 29177, 29268, 29358, 29447, 29534,
+	29621, 29706, 29791, 29874, 29956, 30037, 30117, 30195,
+	30273, 30349, 30424, 30498, 30571, 30643, 30714, 30783,
+	30852, 30919, 30985, 31050, 31113, 31176, 31237, 31297,
+	31356, 31414, 31470, 31526, 31580, 31633, 31685, 31736,
+	31785, 31833, 31880, 31926, 31971, 32014, 32057, 32098,
+	32137, 32176, 32213, 32250, 32285, 32318, 32351, 32382,
+	32412, 32441, 32469, 32495, 32521, 32545, 32567, 32589,
+	32609, 32628, 32646, 32663, 32678, 32692, 32705, 32717,
+	32728, 32737, 32745, 32752, 32757, 32761, 32765, 32766,
+	32767
+};
 
-void ffpl_lvl_dir_to_x_y(const s32 level, const u16 direction, s32 *x, s32 *y)
+/*
+ * Sine of a direction expressed as a fraction of the full circle (0x10000 == 360 degrees).
+ * Top 8 bits of the quarter-wave offset index the table, the remaining 6 bits interpolate.
+ */
+static s32 ffpl_sin16(const u16 direction)
 {
-	const int degrees = direction * 360 / 0xFFFF;
+	const unsigned int quadrant = direction >> 14;
+	unsigned int offset = direction & 0x3fff;
+	unsigned int idx;
+	unsigned int frac;
+	s32 val;
+
+	if (quadrant & 1)
+		offset = 0x4000 - offset;
+	idx = offset >> 6;
+	frac = offset & 0x3f;
+
+	val = ffpl_sin_table[idx];
+	if (frac)
+		val += ((ffpl_sin_table[idx + 1] - val) * (s32)frac) >> 6;
+
+	return (quadrant & 2) ? -val : val;
+}
 
-	printk(KERN_NOTICE "KLGDFF: DIR_TO_DEGREES > Dir: %u, Deg: %u\n", direction, degrees);
-	*x = (level * -fixp_sin16(degrees)) >> FRAC_16;
-	*y = (level * -fixp_cos16(degrees)) >> FRAC_16;
+static s32 ffpl_cos16(const u16 direction)
+{
+	return ffpl_sin16(direction + 0x4000);
+}
+
+void ffpl_lvl_dir_to_x_y(const s32 level, const u16 direction, s32 *x, s32 *y)
+{
+	*x = (level * -ffpl_sin16(direction)) >> FRAC_16;
+	*y = (level * -ffpl_cos16(direction)) >> FRAC_16;
 }
 EXPORT_SYMBOL_GPL(ffpl_lvl_dir_to_x_y);
 
-inline static bool ffpl_process_memless(const struct klgd_plugin_private *priv, const struct ff_effect *eff,
-					const int handler)
+/*
+ * Deadline heap
+ * Pending effects are kept in a binary min-heap ordered by their touch_at
+ * so that the nearest trip point can be read without scanning all effects.
+ */
+static bool ffpl_dl_before(const struct klgd_plugin_private *priv, const unsigned int a, const unsigned int b)
 {
-	bool ret = false;
+	return ktime_before(priv->effects[priv->dl_heap[a]].touch_at, priv->effects[priv->dl_heap[b]].touch_at);
+}
 
-	switch (eff->type) {
-	case FF_CONSTANT:
-		return priv->memless_constant;
-	case FF_PERIODIC:
-		if (FFPL_HANDLER_CF & handler)
-			ret |= priv->memless_periodic;
-		if (FFPL_HANDLER_RUMBLE & handler)
-			ret |= priv->memless_periodic_emul;
-		break;
-	case FF_RAMP:
-		return priv->memless_ramp;
-	case FF_RUMBLE:
-		if (FFPL_HANDLER_CF & handler)
-			ret |= priv->memless_rumble_emul;
-		if (FFPL_HANDLER_RUMBLE & handler)
-			ret |= priv->memless_rumble;
-		break;
-	default:
-		return false;
+static void ffpl_dl_set(struct klgd_plugin_private *priv, const unsigned int pos, const unsigned int idx)
+{
+	priv->dl_heap[pos] = idx;
+	priv->effects[idx].dl_pos = pos;
+}
+
+static void ffpl_dl_swap(struct klgd_plugin_private *priv, const unsigned int a, const unsigned int b)
+{
+	const unsigned int idx = priv->dl_heap[a];
+
+	ffpl_dl_set(priv, a, priv->dl_heap[b]);
+	ffpl_dl_set(priv, b, idx);
+}
+
+static void ffpl_dl_sift_up(struct klgd_plugin_private *priv, unsigned int pos)
+{
+	while (pos > 0) {
+		const unsigned int parent = (pos - 1) / 2;
+
+		if (!ffpl_dl_before(priv, pos, parent))
+			break;
+		ffpl_dl_swap(priv, pos, parent);
+		pos = parent;
 	}
+}
 
-	return ret;
+static void ffpl_dl_sift_down(struct klgd_plugin_private *priv, unsigned int pos)
+{
+	for (;;) {
+		const unsigned int left = 2 * pos + 1;
+		const unsigned int right = left + 1;
+		unsigned int first = pos;
+
+		if (left < priv->dl_count && ffpl_dl_before(priv, left, first))
+			first = left;
+		if (right < priv->dl_count && ffpl_dl_before(priv, right, first))
+			first = right;
+		if (first == pos)
+			break;
+		ffpl_dl_swap(priv, pos, first);
+		pos = first;
+	}
 }
 
-inline static bool ffpl_handle_timing(const struct klgd_plugin_private *priv, const struct ff_effect *eff)
+static void ffpl_dl_insert(struct klgd_plugin_private *priv, const unsigned int idx)
 {
-	if (priv->timing_condition) {
-		switch (eff->type) {
-		case FF_DAMPER:
-		case FF_FRICTION:
-		case FF_INERTIA:
-		case FF_SPRING:
-			return true;
-		}
+	ffpl_dl_set(priv, priv->dl_count++, idx);
+	ffpl_dl_sift_up(priv, priv->dl_count - 1);
+}
+
+static void ffpl_dl_remove(struct klgd_plugin_private *priv, const unsigned int pos)
+{
+	if (--priv->dl_count == pos)
+		return;
+
+	ffpl_dl_set(priv, pos, priv->dl_heap[priv->dl_count]);
+	ffpl_dl_sift_up(priv, pos);
+	ffpl_dl_sift_down(priv, priv->effects[priv->dl_heap[pos]].dl_pos);
+}
+
+/*
+ * KLGD wakes us up with the granularity of jiffies, possibly up to one tick before
+ * the trip point. Recalculations and updates that fall into the current tick are
+ * therefore due. Starts and stops are never processed early, they wait for the
+ * next tick instead and may come up to one tick late.
+ */
+static bool ffpl_is_due(const struct ffpl_effect *eff, const ktime_t now)
+{
+	switch (eff->trigger) {
+	case FFPL_TRIG_START:
+	case FFPL_TRIG_RESTART:
+	case FFPL_TRIG_STOP:
+		return !ktime_after(eff->touch_at, now);
+	default:
+		return !ktime_after(eff->touch_at, ktime_add_ns(now, TICK_NSEC));
 	}
+}
+
+/* Restore the heap order after touch_at of an effect in the heap has changed */
+static void ffpl_dl_update(struct klgd_plugin_private *priv, const unsigned int pos)
+{
+	ffpl_dl_sift_up(priv, pos);
+	ffpl_dl_sift_down(priv, priv->effects[priv->dl_heap[pos]].dl_pos);
+}
+
+/*
+ * Keep the index of started and pending effects in sync with the state of the effect.
+ * Must be called whenever state, active effect, trigger or touch_at of an effect is changed.
+ * Effects entering a combined effect are marked dirty, contributions of effects leaving it are withdrawn.
+ */
+static void ffpl_update_index(struct klgd_plugin_private *priv, struct ffpl_effect *eff)
+{
+	const size_t idx = eff - priv->effects;
+	const bool started = eff->state == FFPL_STARTED;
+
+	if (started && (eff->cls_active.handlers & FFPL_HANDLER_CF)) {
+		if (!__test_and_set_bit(idx, priv->started_cf))
+			__set_bit(idx, priv->dirty_cf);
+	} else if (__test_and_clear_bit(idx, priv->started_cf)) {
+		__clear_bit(idx, priv->dirty_cf);
+		priv->cf_x -= eff->cf_x;
+		priv->cf_y -= eff->cf_y;
+		eff->cf_x = 0;
+		eff->cf_y = 0;
+	}
+
+	if (started && (eff->cls_active.handlers & FFPL_HANDLER_RUMBLE)) {
+		if (!__test_and_set_bit(idx, priv->started_rumble))
+			__set_bit(idx, priv->dirty_rumble);
+	} else if (__test_and_clear_bit(idx, priv->started_rumble)) {
+		__clear_bit(idx, priv->dirty_rumble);
+		priv->strong_x -= eff->strong_x;
+		priv->strong_y -= eff->strong_y;
+		priv->weak_x -= eff->weak_x;
+		priv->weak_y -= eff->weak_y;
+		eff->strong_x = 0;
+		eff->strong_y = 0;
+		eff->weak_x = 0;
+		eff->weak_y = 0;
+	}
+
+	if (eff->trigger != FFPL_TRIG_NONE) {
+		if (__test_and_set_bit(idx, priv->pending))
+			ffpl_dl_update(priv, eff->dl_pos);
+		else
+			ffpl_dl_insert(priv, idx);
+	} else if (__test_and_clear_bit(idx, priv->pending))
+		ffpl_dl_remove(priv, eff->dl_pos);
+}
+
+/* Contribution of a started combinable effect to the combined effect has changed */
+static void ffpl_mark_dirty(struct klgd_plugin_private *priv, const struct ffpl_effect *eff)
+{
+	const size_t idx = eff - priv->effects;
 
-	return ffpl_process_memless(priv, eff, FFPL_HANDLER_ANY);
+	if (test_bit(idx, priv->started_cf))
+		__set_bit(idx, priv->dirty_cf);
+	if (test_bit(idx, priv->started_rumble))
+		__set_bit(idx, priv->dirty_rumble);
 }
 
 static const struct ff_envelope * ffpl_get_envelope(const struct ff_effect *ueff)
@@ -136,6 +288,146 @@ static const struct ff_envelope * ffpl_get_envelope(const struct ff_effect *ueff
 	}
 }
 
+/*
+ * Work out how the plugin has to process an effect.
+ * Hot paths read the cached result instead of looking at the effect type and device flags.
+ */
+static void ffpl_classify_effect(const struct klgd_plugin_private *priv, const struct ff_effect *ueff,
+				 struct ffpl_effect_class *cls)
+{
+	const struct ff_envelope *env = ffpl_get_envelope(ueff);
+	u8 handlers = 0;
+	u8 combiner = 0;
+
+	cls->ticks = false;
+	cls->timed = false;
+
+	switch (ueff->type) {
+	case FF_CONSTANT:
+		if (priv->memless_constant)
+			handlers = FFPL_HANDLER_CF;
+		combiner = FFPL_HANDLER_CF;
+		break;
+	case FF_PERIODIC:
+		if (priv->memless_periodic)
+			handlers |= FFPL_HANDLER_CF;
+		if (priv->memless_periodic_emul)
+			handlers |= FFPL_HANDLER_RUMBLE;
+		combiner = priv->memless_periodic_emul ? FFPL_HANDLER_RUMBLE : FFPL_HANDLER_CF;
+		cls->ticks = true;
+		break;
+	case FF_RAMP:
+		if (priv->memless_ramp)
+			handlers = FFPL_HANDLER_CF;
+		combiner = FFPL_HANDLER_CF;
+		cls->ticks = true;
+		break;
+	case FF_RUMBLE:
+		if (priv->memless_rumble_emul)
+			handlers |= FFPL_HANDLER_CF;
+		if (priv->memless_rumble)
+			handlers |= FFPL_HANDLER_RUMBLE;
+		combiner = priv->memless_rumble_emul ? FFPL_HANDLER_CF : FFPL_HANDLER_RUMBLE;
+		/* Emulated rumble needs to be recalculated under all circumstances */
+		cls->ticks = priv->memless_rumble_emul;
+		break;
+	case FF_DAMPER:
+	case FF_FRICTION:
+	case FF_INERTIA:
+	case FF_SPRING:
+		cls->timed = priv->timing_condition;
+		break;
+	default:
+		break;
+	}
+
+	cls->handlers = handlers;
+	cls->combiner = handlers ? combiner : 0;
+	cls->has_envelope = env && (env->attack_length || env->fade_length);
+	if (handlers)
+		cls->timed = true;
+}
+
+/* Make the latest effect the active one */
+static void ffpl_activate_latest(struct ffpl_effect *eff)
+{
+	eff->active = eff->latest;
+	eff->cls_active = eff->cls_latest;
+	eff->changed = 0;
+}
+
+/*
+ * Find out which parameters of an effect have changed so that
+ * the driver can send only the parts of the effect that differ.
+ * Both effects must be of the same type.
+ */
+static u16 ffpl_changed_fields(const struct ff_effect *ac_eff, const struct ff_effect *la_eff)
+{
+	const struct ff_envelope *ac_env = ffpl_get_envelope(ac_eff);
+	const struct ff_envelope *la_env = ffpl_get_envelope(la_eff);
+	u16 changed = 0;
+
+	if (ac_eff->direction != la_eff->direction)
+		changed |= FFPL_CHANGED_DIRECTION;
+	if (memcmp(&ac_eff->replay, &la_eff->replay, sizeof(ac_eff->replay)))
+		changed |= FFPL_CHANGED_REPLAY;
+	if (memcmp(&ac_eff->trigger, &la_eff->trigger, sizeof(ac_eff->trigger)))
+		changed |= FFPL_CHANGED_TRIGGER;
+	if (ac_env && la_env && memcmp(ac_env, la_env, sizeof(*ac_env)))
+		changed |= FFPL_CHANGED_ENVELOPE;
+
+	switch (la_eff->type) {
+	case FF_CONSTANT:
+		if (ac_eff->u.constant.level != la_eff->u.constant.level)
+			changed |= FFPL_CHANGED_LEVEL;
+		break;
+	case FF_RAMP:
+		if (ac_eff->u.ramp.start_level != la_eff->u.ramp.start_level ||
+		    ac_eff->u.ramp.end_level != la_eff->u.ramp.end_level)
+			changed |= FFPL_CHANGED_LEVEL;
+		break;
+	case FF_PERIODIC:
+		if (ac_eff->u.periodic.magnitude != la_eff->u.periodic.magnitude)
+			changed |= FFPL_CHANGED_LEVEL;
+		if (ac_eff->u.periodic.period != la_eff->u.periodic.period)
+			changed |= FFPL_CHANGED_PERIOD;
+		if (ac_eff->u.periodic.phase != la_eff->u.periodic.phase)
+			changed |= FFPL_CHANGED_PHASE;
+		if (ac_eff->u.periodic.offset != la_eff->u.periodic.offset)
+			changed |= FFPL_CHANGED_OFFSET;
+		break;
+	case FF_RUMBLE:
+		if (ac_eff->u.rumble.strong_magnitude != la_eff->u.rumble.strong_magnitude ||
+		    ac_eff->u.rumble.weak_magnitude != la_eff->u.rumble.weak_magnitude)
+			changed |= FFPL_CHANGED_LEVEL;
+		break;
+	case FF_SPRING:
+	case FF_FRICTION:
+	case FF_DAMPER:
+	case FF_INERTIA:
+		if (memcmp(ac_eff->u.condition, la_eff->u.condition, sizeof(ac_eff->u.condition)))
+			changed |= FFPL_CHANGED_CONDITION;
+		break;
+	default:
+		break;
+	}
+
+	return changed;
+}
+
+/* Effects that differ only in their id */
+static bool ffpl_is_same_effect(const struct ff_effect *a, const struct ff_effect *b)
+{
+	if (a->type != b->type)
+		return false;
+	/* Custom waveforms would have to be compared sample by sample */
+	if (a->type == FF_PERIODIC &&
+	    (a->u.periodic.waveform != b->u.periodic.waveform || a->u.periodic.waveform == FF_CUSTOM))
+		return false;
+
+	return !ffpl_changed_fields(a, b);
+}
+
 static bool ffpl_is_effect_valid(const struct ff_effect *ueff)
 {
 	const u16 length = ueff->replay.length;
@@ -169,59 +461,66 @@ static bool ffpl_is_effect_valid(const struct ff_effect *ueff)
 	return true;
 }
 
-static u16 ffpl_atan_int_octet(const u16 x, const u16 y)
-{
-    u32 result;
-
-    if (!y)
-        return 0x0000;
-
-    /* 3rd order polynomial approximation beween 0 <= y/x <= 1 */
-    result = y * 0x02e2 / x;
-    result = y * (0x05dc + result) / x;
-    result = y * (0x28be - result) / x;
+#define FFPL_CORDIC_ITERATIONS 16
+/* Magnitude of the CORDIC result has to be scaled by this factor, Q30 */
+#define FFPL_CORDIC_GAIN_INV 652032875LL
 
-    return result;
-}
+/* atan(2^-i) in 1/2^24 of the full circle */
+static const s32 ffpl_cordic_atan[FFPL_CORDIC_ITERATIONS] = {
+	2097152, 1238021, 654136, 332050, 166669, 83416, 41718, 20860,
+	10430, 5215, 2608, 1304, 652, 326, 163, 81
+};
 
-static u16 ffpl_atan_int_quarter(const u16 x, const u16 y)
+/*
+ * Calculate magnitude and angle of a vector in the first quadrant by CORDIC vectoring.
+ * The angle is returned in 1/0x10000 of the full circle, 0x4000 being the y axis.
+ * At least one of the coordinates must be nonzero.
+ */
+static void ffpl_cordic_vector(const u32 x, const u32 y, u32 *magnitude, u16 *angle)
 {
-    if (x == y)
-        return 0x2000;
-    else if (x > y)
-        return ffpl_atan_int_octet(x, y);
-    else
-        return 0x4000 - ffpl_atan_int_octet(y, x);
-}
+	/* Normalize the inputs to use the full precision regardless of their size.
+	 * The result grows by up to sqrt(2) for diagonal vectors and by the CORDIC
+	 * gain of ~1.65, leave room for both below 2^31. */
+	const int shift = 29 - fls(max(x, y));
+	s32 _x = shift >= 0 ? x << shift : x >> -shift;
+	s32 _y = shift >= 0 ? y << shift : y >> -shift;
+	s32 z = 0;
+	u64 mag;
+	int i;
+
+	/* Rotate towards the x axis, sign is all ones when y is negative */
+	for (i = 0; i < FFPL_CORDIC_ITERATIONS; i++) {
+		const s32 sign = _y >> 31;
+		const s32 dx = ((_y >> i) ^ sign) - sign;
+		const s32 dy = ((_x >> i) ^ sign) - sign;
+
+		_x += dx;
+		_y -= dy;
+		z += (ffpl_cordic_atan[i] ^ sign) - sign;
+	}
+
+	mag = ((u64)_x * FFPL_CORDIC_GAIN_INV + (1ULL << 29)) >> 30;
+	if (shift > 0)
+		mag = (mag + (1ULL << (shift - 1))) >> shift;
+	else
+		mag <<= -shift;
+	*magnitude = min_t(u64, mag, U32_MAX);
 
+	z = (z + 0x80) >> 8;
+	*angle = clamp(z, 0, 0x4000);
+}
 
 static void ffpl_x_y_to_lvl_dir(const s32 x, const s32 y, s16 *level, u16 *direction)
 {
 	u16 angle;
-	unsigned long pwr;
-	u32 _x = abs(x);
-	u32 _y = abs(y);
-
-	/* It is necessary to make sure that neither of the coordinates exceeds 0xffff.
-	 */
-	if (abs(x) > 0xffff || abs(y) > 0xffff) {
-		u32 div;
-		u32 divx = _x / 0xfffe;
-		u32 divy = _y / 0xfffe;
-
-		div = (divx > divy) ? divx : divy;
-
-		_x /= div;
-		_y /= div;
-
-		if (_x > 0xffff || _y > 0xffff) {
-			_x >>= 1;
-			_y >>= 1;
-		}
+	u32 pwr;
 
+	if (!x && !y) {
+		*level = 0;
+		*direction = 0x8000;
+		return;
 	}
-	angle = (!_x && !_y) ? 0x4000 : ffpl_atan_int_quarter(_x, _y);
-
+	ffpl_cordic_vector(abs(x), abs(y), &pwr, &angle);
 
 	/* 1st quadrant */
 	if (x >= 0 && y >= 0)
@@ -238,63 +537,137 @@ static void ffpl_x_y_to_lvl_dir(const s32 x, const s32 y, s16 *level, u16 *direc
 	else
 		*direction = 0x0000;
 
-	if (abs(x) > 0x7fff || abs(y) > 0x7fff) {
-		*level = 0x7fff;
+	*level = (pwr > 0x7fff) ? 0x7fff : pwr;
+}
+
+static void ffpl_add_env_segment(struct ffpl_effect *eff, const ktime_t begin, const ktime_t end,
+				 const s32 from, const s32 to)
+{
+	struct ffpl_env_segment *seg = &eff->env_segs[eff->env_seg_count];
+
+	/* Segments of zero length are never reached */
+	if (ktime_compare(begin, end) == 0 && eff->env_seg_count)
 		return;
-	}
 
-	pwr = int_sqrt(x * x + y * y);
-	*level = (pwr > 0x7fff) ? 0x7fff : pwr;
+	seg->begin = begin;
+	seg->length = ktime_to_ns(ktime_sub(end, begin));
+	seg->level = from;
+	seg->slope = seg->length ? div64_s64((s64)(to - from) << FFPL_ENV_SLOPE_SHIFT, seg->length) : 0;
+	eff->env_seg_count++;
 }
 
-static s32 ffpl_apply_envelope(const struct ffpl_effect *eff, const unsigned long now)
+/*
+ * Compile the envelope of the latest effect into attack, sustain and fade segments
+ * with absolute boundaries. Must be called whenever the effect or its trip times change.
+ */
+static void ffpl_compile_envelope(struct ffpl_effect *eff)
 {
-	const struct ff_effect *ueff = &eff->active;
+	const struct ff_effect *ueff = &eff->latest;
 	const struct ff_envelope *env = ffpl_get_envelope(ueff);
-	s32 abs_level;
-	s32 level;
-	unsigned long atk_end;
-	unsigned long fade_begin;
-
+	const bool finite = ueff->replay.length;
+	ktime_t atk_end;
+	ktime_t fade_begin;
+	s32 atk_level;
+	s32 sus_begin_level;
+	s32 sus_end_level;
+	s32 fade_level;
+
+	eff->env_seg_count = 0;
 	if (!env)
-		return 0;
+		return;
+
+	atk_end = ktime_add_ms(eff->start_at, env->attack_length);
+	if (finite && ktime_after(atk_end, eff->stop_at))
+		atk_end = eff->stop_at;
+	fade_begin = finite ? ktime_sub_ms(eff->stop_at, env->fade_length) : atk_end;
+	if (ktime_before(fade_begin, atk_end))
+		fade_begin = atk_end;
 
 	switch (ueff->type) {
 	case FF_CONSTANT:
-		level = ueff->u.constant.level;
-		break;
 	case FF_PERIODIC:
-		level = ueff->u.periodic.magnitude;
+	{
+		const s32 level = ueff->type == FF_CONSTANT ? ueff->u.constant.level : ueff->u.periodic.magnitude;
+
+		atk_level = level < 0 ? -env->attack_level : env->attack_level;
+		fade_level = level < 0 ? -env->fade_level : env->fade_level;
+		sus_begin_level = level;
+		sus_end_level = level;
 		break;
+	}
 	case FF_RAMP:
-		printk(KERN_NOTICE "KLGDFF: FF_RAMP envelope is not handled yet\n");
-		return 0;
+	{
+		/* Envelope levels of ramps are relative to the mean level */
+		const s32 start = ueff->u.ramp.start_level;
+		const s32 end = ueff->u.ramp.end_level;
+		const s32 mean = (start + end) / 2;
+		const s64 length = ktime_to_ns(ktime_sub(eff->stop_at, eff->start_at));
+
+		atk_level = end > start ? mean - env->attack_level : mean + env->attack_level;
+		fade_level = end > start ? mean + env->fade_level : mean - env->fade_level;
+		if (length) {
+			sus_begin_level = start + div64_s64((end - start) * ktime_to_ns(ktime_sub(atk_end, eff->start_at)), length);
+			sus_end_level = start + div64_s64((end - start) * ktime_to_ns(ktime_sub(fade_begin, eff->start_at)), length);
+		} else {
+			sus_begin_level = start;
+			sus_end_level = start;
+		}
+		break;
+	}
 	default:
-		WARN(true, "KLGDFF: Invalid effect passed to envelope calculation. This cannot happen!\n");
-		return 0;
+		return;
 	}
-	abs_level = abs(level);
-	atk_end = eff->start_at + msecs_to_jiffies(env->attack_length);
-	fade_begin = eff->stop_at - msecs_to_jiffies(env->fade_length);
 
-	/* Effect has an envelope with nonzero attack time */
-	if (env->attack_length && time_before(now, atk_end)) {
-		const s32 clength = jiffies_to_msecs(now - eff->start_at);
-		const s32 alength = env->attack_length;
-		const s32 dlevel = (abs_level - env->attack_level) * clength / alength;
-		return level < 0 ? -(dlevel + env->attack_level) :
-				    (dlevel + env->attack_level);
-	} else if (env->fade_length && time_before_eq(fade_begin, now)) {
-		const s32 clength = jiffies_to_msecs(now - fade_begin);
-		const s32 flength = env->fade_length;
-		const s32 dlevel = (env->fade_level - abs_level) * clength / flength;
-		return level < 0 ? -(dlevel + abs_level) : (dlevel + abs_level);
+	if (env->attack_length)
+		ffpl_add_env_segment(eff, eff->start_at, atk_end, atk_level, sus_begin_level);
+	if (finite) {
+		ffpl_add_env_segment(eff, atk_end, fade_begin, sus_begin_level, sus_end_level);
+		if (env->fade_length)
+			ffpl_add_env_segment(eff, fade_begin, eff->stop_at, sus_end_level, fade_level);
+	} else {
+		/* Effects without an end sustain the level reached by the attack forever */
+		struct ffpl_env_segment *seg = &eff->env_segs[eff->env_seg_count++];
+
+		seg->begin = atk_end;
+		seg->length = 0;
+		seg->level = sus_begin_level;
+		seg->slope = 0;
 	}
+}
+
+static const struct ffpl_env_segment *ffpl_get_env_segment(const struct ffpl_effect *eff, const ktime_t now)
+{
+	unsigned int idx;
+
+	if (!eff->env_seg_count)
+		return NULL;
+
+	idx = eff->env_seg_count - 1;
+	while (idx && ktime_before(now, eff->env_segs[idx].begin))
+		idx--;
+
+	return &eff->env_segs[idx];
+}
+
+/* Level of an effect with its envelope applied */
+static s32 ffpl_apply_envelope(const struct ffpl_effect *eff, const ktime_t now)
+{
+	const struct ffpl_env_segment *seg = ffpl_get_env_segment(eff, now);
+	u64 t;
+
+	if (!seg)
+		return 0;
+	if (ktime_before(now, seg->begin))
+		return seg->level;
+
+	t = ktime_to_ns(ktime_sub(now, seg->begin));
+	if (seg->length && t > seg->length)
+		t = seg->length;
 
-	return level;
+	return seg->level + (s32)((seg->slope * (s64)t + (1LL << (FFPL_ENV_SLOPE_SHIFT - 1))) >> FFPL_ENV_SLOPE_SHIFT);
 }
 
-static void ffpl_constant_to_x_y(const struct ffpl_effect *eff, s32 *x, s32 *y, const unsigned long now)
+static void ffpl_constant_to_x_y(const struct ffpl_effect *eff, s32 *x, s32 *y, const ktime_t now)
 {
 	const struct ff_effect *ueff = &eff->active;
 	const s32 level = ffpl_apply_envelope(eff, now);
@@ -302,43 +675,54 @@ static void ffpl_constant_to_x_y(const struct ffpl_effect *eff, s32 *x, s32 *y,
 	ffpl_lvl_dir_to_x_y(level, ueff->direction, x, y);
 }
 
-static void ffpl_periodic_to_x_y(struct ffpl_effect *eff, s32 *x, s32 *y, const unsigned long now)
+/*
+ * Precompute phase increments of a periodic effect so that no divisions
+ * are needed to evaluate the waveform. Phase wraps around with the period.
+ */
+static void ffpl_calculate_phase_step(struct ffpl_effect *eff)
 {
-	const struct ff_effect *ueff = &eff->active;
+	const struct ff_effect *ueff = &eff->latest;
 	const u16 period = ueff->u.periodic.period;
+
+	if (ueff->type != FF_PERIODIC || !period) {
+		eff->phase_step = 0;
+		eff->phase_offset = 0;
+		return;
+	}
+
+	/* 2^64 / period, the phase wraps around at the end of each period */
+	eff->phase_step = div64_u64(U64_MAX, (u64)period * NSEC_PER_MSEC);
+	eff->phase_offset = div_u64((u64)ueff->u.periodic.phase << 32, period) << 32;
+}
+
+static void ffpl_periodic_to_x_y(struct ffpl_effect *eff, s32 *x, s32 *y, const ktime_t now)
+{
+	const struct ff_effect *ueff = &eff->active;
 	const s16 offset = ueff->u.periodic.offset;
 	const s32 level = ffpl_apply_envelope(eff, now);
 	s32 new = 0;
-	u16 t;
+	u32 t;
 
-	eff->playback_time += jiffies_to_msecs(now - eff->updated_at);
-	eff->playback_time %= period;
-	t = (eff->playback_time + ueff->u.periodic.phase) % period;
-
-	printk(KERN_NOTICE "KLGDFF: PT: %u, t: %u, dt: %lu\n", eff->playback_time, t, now - eff->updated_at);
+	eff->phase += eff->phase_step * ktime_to_ns(ktime_sub(now, eff->updated_at));
+	/* Round to the 16 bits of phase used by the waveforms */
+	t = ((eff->phase + eff->phase_offset + (1ULL << 47)) >> 32) & 0xffff0000U;
 
 	switch (ueff->u.periodic.waveform) {
 	case FF_SINE:
-	{
-		u16 degrees = (360 * t) / period;
-		new = ((level * fixp_sin16(degrees)) >> FRAC_16) + offset;
+		new = ((level * ffpl_sin16(t >> 16)) >> FRAC_16) + offset;
 		break;
-	}
 	case FF_SQUARE:
-	{
-		u16 degrees = (360 * t) / period;
-		new = level * (degrees < 180 ? 1 : -1) + offset;
+		new = level * (t < 0x80000000U ? 1 : -1) + offset;
 		break;
-	}
 	case FF_SAW_UP:
-		new = 2 * level * t / period - level + offset;
+		new = ((level * (s32)(t >> 16)) >> FRAC_16) - level + offset;
 		break;
 	case FF_SAW_DOWN:
-		new = level - 2 * level * t / period + offset;
+		new = level - ((level * (s32)(t >> 16)) >> FRAC_16) + offset;
 		break;
 	case FF_TRIANGLE:
 	{
-		new = (2 * abs(level - (2 * level * t) / period));
+		new = (2 * abs(level - ((level * (s32)(t >> 16)) >> FRAC_16)));
 		new = new - abs(level) + offset;
 		break;
 	}
@@ -352,56 +736,25 @@ static void ffpl_periodic_to_x_y(struct ffpl_effect *eff, s32 *x, s32 *y, const
 
 	/* Ensure that the offset did not make the value exceed s16 range */
 	new = clamp(new, -0x7fff, 0x7fff);
-	printk(KERN_NOTICE "KLGDFF: Periodic %d\n", new);
 	ffpl_lvl_dir_to_x_y(new, ueff->direction, x, y);
 }
 
-static void ffpl_ramp_to_x_y(struct ffpl_effect *eff, s32 *x, s32 *y, const unsigned long now)
+static void ffpl_ramp_to_x_y(struct ffpl_effect *eff, s32 *x, s32 *y, const ktime_t now)
 {
 	const struct ff_effect *ueff = &eff->active;
-	const struct ff_envelope *env = ffpl_get_envelope(ueff);
-	const u16 length = ueff->replay.length;
-	const s16 mean = (ueff->u.ramp.start_level + ueff->u.ramp.end_level) / 2;
-	const u16 t = jiffies_to_msecs(now - eff->start_at);
-	const unsigned long attack_stop = eff->start_at + env->attack_length;
-	const unsigned long fade_begin = eff->stop_at - env->fade_length;
-	s32 start = ueff->u.ramp.start_level;
-	s32 end = ueff->u.ramp.end_level;
-	s32 new;
-
-	if (env->attack_length && time_before(now, attack_stop)) {
-		const s32 clength = jiffies_to_msecs(now - eff->start_at);
-		const s32 alength = env->attack_length;
-		s32 attack_level;
-		if (end > start)
-			attack_level = mean - env->attack_level;
-		else
-			attack_level = mean + env->attack_level;
-		start = (start - attack_level) * clength / alength + attack_level;
-	} else if (env->fade_length && time_before_eq(fade_begin, now)) {
-		const s32 clength = jiffies_to_msecs(now - fade_begin);
-		const s32 flength = env->fade_length;
-		s32 fade_level;
-		if (end > start)
-			fade_level = mean + env->fade_level;
-		else
-			fade_level = mean - env->fade_level;
-		end = (fade_level - end) * clength / flength + end;
-	}
+	const s32 level = clamp(ffpl_apply_envelope(eff, now), -0x7fff, 0x7fff);
 
-	new = ((end - start) * t) / length + start;
-	new = clamp(new, -0x7fff, 0x7fff);
-	ffpl_lvl_dir_to_x_y(new, ueff->direction, x, y);
+	ffpl_lvl_dir_to_x_y(level, ueff->direction, x, y);
 }
 
 /*
  * Emulate FF_RUMBLE effects through FF_CONSTANT
  */
-static void ffpl_rumble_to_x_y(struct ffpl_effect *eff, s32 *x, s32 *y, const unsigned long now)
+static void ffpl_rumble_to_x_y(struct ffpl_effect *eff, s32 *x, s32 *y, const ktime_t now)
 {
 	bool direction_up;
 	bool direction_left;
-	const unsigned long update_rate = msecs_to_jiffies(RECALC_DELTA_T_MSEC);
+	const u32 quarter = FFPL_RUMBLE_EMUL_QUARTER_NSEC;
 	const struct ff_effect *ueff = &eff->active;
 	const u16 strong = ueff->u.rumble.strong_magnitude;
 	const u16 weak = ueff->u.rumble.weak_magnitude;
@@ -409,40 +762,39 @@ static void ffpl_rumble_to_x_y(struct ffpl_effect *eff, s32 *x, s32 *y, const un
 	/* This will synchronise all simultaneously playing emul rumble effects,     */
 	/* otherwise non-deterministic phase-inversions could occur depending on     */
 	/* upload time, which could lead to undesired cancellation of these effects. */
-	const unsigned long t = now % (4UL * update_rate);
+	u32 t;
 	s32 level = 0;
 
+	div_u64_rem(ktime_to_ns(now), 4 * quarter, &t);
 	if (strong)
-		level += (strong / 4) * (t < 2UL * update_rate ? 1 : -1);
+		level += (strong / 4) * (t < 2UL * quarter ? 1 : -1);
 	if (weak)
-		level += (weak / 4) * (t < 2UL * update_rate ?
-					(t < 1UL * update_rate ? 1 : -1) :
-					(t < 3UL * update_rate ? 1 : -1));
+		level += (weak / 4) * (t < 2UL * quarter ?
+					(t < 1UL * quarter ? 1 : -1) :
+					(t < 3UL * quarter ? 1 : -1));
 	direction_up = (ueff->direction > 0x3fffU && ueff->direction <= 0xbfffU);
 	direction_left = (ueff->direction <= 0x7fffU);
 
-	*x += direction_left ? -level : level;
-	*y += direction_up ? -level : level;
+	*x = direction_left ? -level : level;
+	*y = direction_up ? -level : level;
 }
 
-static void ffpl_recalc_combined_cf(struct klgd_plugin_private *priv, const unsigned long now)
+/*
+ * Update the combined constant force effect.
+ * Only the effects marked as dirty are reevaluated, contributions
+ * of the remaining effects are already accounted for in priv->cf_x and priv->cf_y.
+ */
+static void ffpl_recalc_combined_cf(struct klgd_plugin_private *priv, const ktime_t now)
 {
 	size_t idx;
 	struct ff_effect *cb_latest = &priv->combined_effect_cf.latest;
-	s32 x = 0;
-	s32 y = 0;
 
-	for (idx = 0; idx < priv->effect_count; idx++) {
+	for_each_set_bit(idx, priv->dirty_cf, priv->effect_count) {
 		struct ffpl_effect *eff = &priv->effects[idx];
 		struct ff_effect *ueff = &eff->active;
 		s32 _x;
 		s32 _y;
 
-		if (!ffpl_process_memless(priv, ueff, FFPL_HANDLER_CF))
-			continue;
-		if (eff->state != FFPL_STARTED)
-			continue;
-
 		switch (ueff->type) {
 		case FF_CONSTANT:
 			ffpl_constant_to_x_y(eff, &_x, &_y, now);
@@ -457,19 +809,22 @@ static void ffpl_recalc_combined_cf(struct klgd_plugin_private *priv, const unsi
 			ffpl_rumble_to_x_y(eff, &_x, &_y, now);
 			break;
 		default:
-			continue;
+			_x = 0;
+			_y = 0;
 			break;
 		}
 
 		eff->updated_at = now;
-		x += _x;
-		y += _y;
+		priv->cf_x += _x - eff->cf_x;
+		priv->cf_y += _y - eff->cf_y;
+		eff->cf_x = _x;
+		eff->cf_y = _y;
 	}
+	bitmap_zero(priv->dirty_cf, priv->effect_count);
 
-	ffpl_x_y_to_lvl_dir(x, y, &cb_latest->u.constant.level, &cb_latest->direction);
+	ffpl_x_y_to_lvl_dir(priv->cf_x, priv->cf_y, &cb_latest->u.constant.level, &cb_latest->direction);
 	cb_latest->type = FF_CONSTANT;
-	printk(KERN_NOTICE "KLGDFF: Resulting combined CF effect > x: %d, y: %d, level: %d, direction: %u\n", x, y, cb_latest->u.constant.level,
-	       cb_latest->direction);
+	trace_klgdff_combined_cf(priv->cf_x, priv->cf_y, cb_latest->u.constant.level, cb_latest->direction);
 }
 
 static u16 ffpl_set_rumble_direction(const u16 strong_dir, const u16 weak_dir)
@@ -488,32 +843,27 @@ static u16 ffpl_set_rumble_direction(const u16 strong_dir, const u16 weak_dir)
 	return dir;
 }
 
-static void ffpl_recalc_combined_rumble(struct klgd_plugin_private *priv, const unsigned long now)
+/*
+ * Update the combined rumble effect.
+ * Works incrementally the same way as ffpl_recalc_combined_cf()
+ */
+static void ffpl_recalc_combined_rumble(struct klgd_plugin_private *priv, const ktime_t now)
 {
 	size_t idx;
 	struct ff_effect *cb_latest = &priv->combined_effect_rumble.latest;
-	s32 strong_x = 0;
-	s32 strong_y = 0;
-	s32 weak_x = 0;
-	s32 weak_y = 0;
 	/* Resulting overall values expressed as direction and magnitude */
 	s16 strong_mag;
 	u16 strong_dir;
 	s16 weak_mag;
 	u16 weak_dir;
 
-	for (idx = 0; idx < priv->effect_count; idx++) {
+	for_each_set_bit(idx, priv->dirty_rumble, priv->effect_count) {
 		struct ffpl_effect *eff = &priv->effects[idx];
 		struct ff_effect *ueff = &eff->active;
-		s32 _strong_x;
-		s32 _strong_y;
-		s32 _weak_x;
-		s32 _weak_y;
-
-		if (!ffpl_process_memless(priv, ueff, FFPL_HANDLER_RUMBLE))
-			continue;
-		if (eff->state != FFPL_STARTED)
-			continue;
+		s32 _strong_x = 0;
+		s32 _strong_y = 0;
+		s32 _weak_x = 0;
+		s32 _weak_y = 0;
 
 		switch (ueff->type) {
 		case FF_RUMBLE:
@@ -528,55 +878,343 @@ static void ffpl_recalc_combined_rumble(struct klgd_plugin_private *priv, const
 			break;
 		}
 		default:
-			continue;
 			break;
 		}
-		strong_x += _strong_x;
-		strong_y += _strong_y;
-		weak_x += _weak_x;
-		weak_y += _weak_y;
-	}
-
-	ffpl_x_y_to_lvl_dir(strong_x, strong_y, &strong_mag, &strong_dir);
-	ffpl_x_y_to_lvl_dir(weak_x, weak_y, &weak_mag, &weak_dir);
+		priv->strong_x += _strong_x - eff->strong_x;
+		priv->strong_y += _strong_y - eff->strong_y;
+		priv->weak_x += _weak_x - eff->weak_x;
+		priv->weak_y += _weak_y - eff->weak_y;
+		eff->strong_x = _strong_x;
+		eff->strong_y = _strong_y;
+		eff->weak_x = _weak_x;
+		eff->weak_y = _weak_y;
+	}
+	bitmap_zero(priv->dirty_rumble, priv->effect_count);
+
+	ffpl_x_y_to_lvl_dir(priv->strong_x, priv->strong_y, &strong_mag, &strong_dir);
+	ffpl_x_y_to_lvl_dir(priv->weak_x, priv->weak_y, &weak_mag, &weak_dir);
 	cb_latest->direction = ffpl_set_rumble_direction(strong_dir, weak_dir);
 	cb_latest->u.rumble.strong_magnitude = (u16)strong_mag * 2;
 	cb_latest->u.rumble.weak_magnitude = (u16)weak_mag * 2;
 	cb_latest->type = FF_RUMBLE;
+	trace_klgdff_combined_rumble(cb_latest->u.rumble.strong_magnitude, cb_latest->u.rumble.weak_magnitude,
+				     cb_latest->direction);
 }
 
-static int ffpl_erase_effect(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff)
+/*
+ * Check whether the recalculated combined constant force differs from the force
+ * last sent to the device by no more than the device can resolve.
+ */
+static bool ffpl_cf_within_deadband(struct klgd_plugin_private *priv)
 {
-	if (eff->uploaded_to_device) {
-		struct input_dev *dev = priv->dev;
-		union ffpl_control_data data;
-		int ret;
+	const struct ff_effect *sent = &priv->combined_effect_cf.active;
+	const struct ff_effect *cur = &priv->combined_effect_cf.latest;
+	s32 sent_x, sent_y;
+	s32 cur_x, cur_y;
 
-		data.effects.cur = &eff->active;
-		data.effects.old = NULL;
-		ret = priv->control(dev, s, FFPL_UPL_TO_EMP, data, priv->user);
-		if (ret)
-			return ret;
-	}
+	if (sent->type != FF_CONSTANT)
+		return false;
 
-	eff->state = FFPL_EMPTY;
-	eff->uploaded_to_device = false;
-	return 0;
-}
+	if (sent->u.constant.level == cur->u.constant.level &&
+	    (sent->direction == cur->direction || !cur->u.constant.level))
+		goto suppress;
+	if (!priv->deadband)
+		return false;
+
+	/* Compare the forces as vectors, direction matters only as much as the level */
+	ffpl_lvl_dir_to_x_y(sent->u.constant.level, sent->direction, &sent_x, &sent_y);
+	ffpl_lvl_dir_to_x_y(cur->u.constant.level, cur->direction, &cur_x, &cur_y);
+	if (abs(cur_x - sent_x) > priv->deadband || abs(cur_y - sent_y) > priv->deadband)
+		return false;
+
+suppress:
+	priv->updates_suppressed++;
+	return true;
+}
+
+/*
+ * Same as ffpl_cf_within_deadband() for the combined rumble effect.
+ * Directions of rumble effects are reduced to quadrants and have to match exactly.
+ */
+static bool ffpl_rumble_within_deadband(struct klgd_plugin_private *priv)
+{
+	const struct ff_effect *sent = &priv->combined_effect_rumble.active;
+	const struct ff_effect *cur = &priv->combined_effect_rumble.latest;
+
+	if (sent->type != FF_RUMBLE || sent->direction != cur->direction)
+		return false;
+	if (abs(cur->u.rumble.strong_magnitude - sent->u.rumble.strong_magnitude) > priv->deadband ||
+	    abs(cur->u.rumble.weak_magnitude - sent->u.rumble.weak_magnitude) > priv->deadband)
+		return false;
+
+	priv->updates_suppressed++;
+	return true;
+}
+
+/* Keep a moving average of the time the driver needs to process an upload */
+static void ffpl_account_upload(struct klgd_plugin_private *priv, const ktime_t elapsed)
+{
+	const u64 ns = ktime_to_ns(elapsed);
+
+	priv->upload_latency = priv->upload_latency ? priv->upload_latency - (priv->upload_latency >> 3) + (ns >> 3) : ns;
+}
+
+/* Pass all transitions collected so far to the driver */
+static int ffpl_flush_batch(struct klgd_plugin_private *priv, struct klgd_command_stream *s)
+{
+	ktime_t begin;
+	ktime_t elapsed;
+	bool uploads = false;
+	size_t idx;
+	int ret;
+
+	if (!priv->batch_count)
+		return 0;
+
+	for (idx = 0; idx < priv->batch_count; idx++) {
+		if (priv->batch[idx].cmd == FFPL_EMP_TO_UPL || priv->batch[idx].cmd == FFPL_EMP_TO_SRT)
+			uploads = true;
+	}
+
+	begin = ktime_get();
+	ret = priv->batch_control(priv->dev, s, priv->batch, priv->batch_count, priv->user);
+	elapsed = ktime_sub(ktime_get(), begin);
+	priv->control_time += ktime_to_ns(elapsed);
+	/* Whole report counts as the cost of the upload it carries */
+	if (uploads)
+		ffpl_account_upload(priv, elapsed);
+	priv->batch_count = 0;
+	return ret;
+}
+
+static int ffpl_queue_transition(struct klgd_plugin_private *priv, struct klgd_command_stream *s,
+				 const enum ffpl_control_command cmd, const union ffpl_control_data data)
+{
+	struct ffpl_transition *t;
+
+	if (priv->batch_count == priv->stream_capacity) {
+		const int ret = ffpl_flush_batch(priv, s);
+
+		if (ret)
+			return ret;
+	}
+
+	t = &priv->batch[priv->batch_count++];
+	t->cmd = cmd;
+	t->data = data;
+	switch (cmd) {
+	case FFPL_SET_GAIN:
+	case FFPL_SET_AUTOCENTER:
+		break;
+	default:
+		/* Effects may change before the batch is flushed, keep a copy */
+		t->cur = *data.effects.cur;
+		t->data.effects.cur = &t->cur;
+		if (data.effects.old) {
+			t->old = *data.effects.old;
+			t->data.effects.old = &t->old;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static int ffpl_control(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff,
+			const enum ffpl_control_command cmd, const union ffpl_control_data data);
+
+/*
+ * Find a device slot for an effect that is about to be uploaded.
+ * If all slots are taken, the least recently used idle effect is erased from the device.
+ */
+static int ffpl_claim_slot(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff)
+{
+	struct ffpl_effect *victim;
+	union ffpl_control_data data;
+	unsigned int idx;
+	int ret;
+
+	if (eff->hw_slot >= 0)
+		return 0;
+
+	for (idx = 0; idx < priv->hw_slots; idx++) {
+		if (!priv->hw_owners[idx]) {
+			eff->hw_slot = idx;
+			priv->hw_owners[idx] = eff;
+			return 0;
+		}
+	}
+
+	victim = list_first_entry_or_null(&priv->hw_lru, struct ffpl_effect, hw_lru);
+	if (!victim) {
+		/* Flag it so that this cannot be mistaken for an error of the driver */
+		priv->slot_exhausted = true;
+		return -ENOSPC;
+	}
+
+	/* Evicted effect stays uploaded as far as userspace is concerned */
+	pr_debug("KLGDFF: Evicting effect %d from device slot %d\n", victim->active.id, victim->hw_slot);
+	data.effects.cur = &victim->active;
+	data.effects.old = NULL;
+	ret = ffpl_control(priv, s, victim, FFPL_UPL_TO_EMP, data);
+	if (ret)
+		return ret;
+	victim->uploaded_to_device = false;
+	priv->slot_evictions++;
+
+	return ffpl_claim_slot(priv, s, eff);
+}
+
+static bool ffpl_slot_available(const struct klgd_plugin_private *priv, const struct ffpl_effect *eff)
+{
+	unsigned int idx;
+
+	if (!priv->hw_slots || eff->hw_slot >= 0)
+		return true;
+
+	for (idx = 0; idx < priv->hw_slots; idx++) {
+		if (!priv->hw_owners[idx])
+			return true;
+	}
+	return false;
+}
+
+/* Keep the LRU of idle effects on the device in sync with the commands sent to it */
+static void ffpl_track_slot(struct klgd_plugin_private *priv, struct ffpl_effect *eff, const enum ffpl_control_command cmd)
+{
+	switch (cmd) {
+	case FFPL_EMP_TO_UPL:
+	case FFPL_SRT_TO_UPL:
+	case FFPL_OWR_TO_UPL:
+		list_move_tail(&eff->hw_lru, &priv->hw_lru);
+		break;
+	case FFPL_UPL_TO_SRT:
+	case FFPL_EMP_TO_SRT:
+	case FFPL_OWR_TO_SRT:
+		list_del_init(&eff->hw_lru);
+		break;
+	case FFPL_UPL_TO_EMP:
+	case FFPL_SRT_TO_EMP:
+		list_del_init(&eff->hw_lru);
+		priv->hw_owners[eff->hw_slot] = NULL;
+		eff->hw_slot = -1;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Pass a command to the driver and charge it against the command budget.
+ * Drivers with a batch control callback get the commands when ffpl_get_commands() finishes.
+ * When the device has fewer slots than userspace, effects are given to the driver
+ * with the number of the device slot as their id.
+ */
+static int ffpl_control(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff,
+			const enum ffpl_control_command cmd, const union ffpl_control_data data)
+{
+	union ffpl_control_data _data = data;
+	struct ff_effect cur;
+	struct ff_effect old;
+	int ret;
+
+	if (priv->hw_slots && eff) {
+		if (cmd == FFPL_EMP_TO_UPL || cmd == FFPL_EMP_TO_SRT) {
+			ret = ffpl_claim_slot(priv, s, eff);
+			if (ret)
+				return ret;
+		}
+
+		cur = *data.effects.cur;
+		cur.id = eff->hw_slot;
+		_data.effects.cur = &cur;
+		if (data.effects.old) {
+			old = *data.effects.old;
+			old.id = eff->hw_slot;
+			_data.effects.old = &old;
+		}
+	}
+
+	if (priv->batch_control) {
+		ret = ffpl_queue_transition(priv, s, cmd, _data);
+	} else {
+		const ktime_t begin = ktime_get();
+		ktime_t elapsed;
+
+		ret = priv->control(priv->dev, s, cmd, _data, priv->user);
+		elapsed = ktime_sub(ktime_get(), begin);
+		priv->control_time += ktime_to_ns(elapsed);
+		if (cmd == FFPL_EMP_TO_UPL || cmd == FFPL_EMP_TO_SRT)
+			ffpl_account_upload(priv, elapsed);
+	}
+	trace_klgdff_control(cmd, &_data, ret);
+	if (ret)
+		return ret;
+
+	priv->commands[cmd]++;
+	if (eff)
+		eff->stats.commands++;
+	priv->budget_used++;
+	if (priv->hw_slots && eff)
+		ffpl_track_slot(priv, eff, cmd);
+	return 0;
+}
+
+/* Start a new budget window if the current one has elapsed */
+static void ffpl_refill_budget(struct klgd_plugin_private *priv, const ktime_t now)
+{
+	if (!priv->budget || ktime_before(now, priv->budget_reset_at))
+		return;
+
+	priv->budget_used = 0;
+	priv->budget_reset_at = ktime_add_ns(now, priv->budget_window);
+}
+
+/*
+ * Updates of started effects are the only commands that can be postponed.
+ * Everything else changes the state of the device and is always sent.
+ */
+static bool ffpl_defer_update(struct klgd_plugin_private *priv, const struct ffpl_effect *eff)
+{
+	if (eff->change != FFPL_TO_UPDATE || eff->replace || eff->state != FFPL_STARTED)
+		return false;
+	if (!priv->budget || priv->budget_used < priv->budget)
+		return false;
+
+	priv->cmds_deferred++;
+	return true;
+}
+
+static int ffpl_erase_effect(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff)
+{
+	if (eff->uploaded_to_device) {
+		union ffpl_control_data data;
+		int ret;
+
+		data.effects.cur = &eff->active;
+		data.effects.old = NULL;
+		ret = ffpl_control(priv, s, eff, FFPL_UPL_TO_EMP, data);
+		if (ret)
+			return ret;
+	}
+
+	eff->state = FFPL_EMPTY;
+	eff->uploaded_to_device = false;
+	return 0;
+}
 
 static int ffpl_replace_effect(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff,
 			       const enum ffpl_control_command cmd)
 {
-	struct input_dev *dev = priv->dev;
 	union ffpl_control_data data;
 	int ret;
 
 	data.effects.cur = &eff->latest;
 	data.effects.old = &eff->active;
 	data.effects.repeat = eff->repeat;
-	ret = priv->control(dev, s, cmd, data, priv->user);
+	ret = ffpl_control(priv, s, eff, cmd, data);
 	if (!ret) {
-		eff->active = eff->latest;
+		ffpl_activate_latest(eff);
 		eff->state = (cmd == FFPL_OWR_TO_UPL) ? FFPL_UPLOADED : FFPL_STARTED;
 		eff->replace = false;
 		eff->change = FFPL_DONT_TOUCH;
@@ -587,13 +1225,14 @@ static int ffpl_replace_effect(struct klgd_plugin_private *priv, struct klgd_com
 
 static int ffpl_start_effect(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff)
 {
-	struct input_dev *dev = priv->dev;
 	union ffpl_control_data data;
 	int ret;
 	enum ffpl_control_command cmd;
+	const bool slot_hit = eff->uploaded_to_device;
 
 	data.effects.old = NULL;
 	data.effects.repeat = eff->repeat;
+
 	if (priv->upload_when_started && eff->state == FFPL_UPLOADED) {
 		data.effects.cur = &eff->active;
 		if (eff->uploaded_to_device)
@@ -601,7 +1240,7 @@ static int ffpl_start_effect(struct klgd_plugin_private *priv, struct klgd_comma
 		else
 			cmd = FFPL_EMP_TO_SRT;
 
-		ret = priv->control(dev, s, cmd, data, priv->user);
+		ret = ffpl_control(priv, s, eff, cmd, data);
 		if (ret)
 			return ret;
 	} else {
@@ -609,18 +1248,37 @@ static int ffpl_start_effect(struct klgd_plugin_private *priv, struct klgd_comma
 		if (eff->state == FFPL_EMPTY) {
 			data.effects.cur = &eff->latest;
 			cmd = FFPL_EMP_TO_SRT;
+		} else if (!eff->uploaded_to_device) {
+			/* Effect was erased from the device when it was stopped or evicted, upload it again */
+			data.effects.cur = &eff->active;
+			if (priv->has_emp_to_srt) {
+				cmd = FFPL_EMP_TO_SRT;
+			} else {
+				ret = ffpl_control(priv, s, eff, FFPL_EMP_TO_UPL, data);
+				if (ret)
+					return ret;
+				eff->uploaded_to_device = true;
+				cmd = FFPL_UPL_TO_SRT;
+			}
 		} else {
 			data.effects.cur = &eff->active;
 			cmd = FFPL_UPL_TO_SRT;
 		}
 
-		ret = priv->control(dev, s, cmd, data, priv->user);
+		ret = ffpl_control(priv, s, eff, cmd, data);
 		if (ret)
 			return ret;
-		if (cmd == FFPL_EMP_TO_SRT)
-			eff->active = eff->latest;
+		/* Re-upload of an evicted effect sends the active effect, latest has not reached the device */
+		if (data.effects.cur == &eff->latest)
+			ffpl_activate_latest(eff);
 	}
 
+	if (priv->hw_slots) {
+		if (slot_hit)
+			priv->slot_hits++;
+		else
+			priv->slot_misses++;
+	}
 	eff->uploaded_to_device = true; /* Needed of devices that support "upload and start" but don't use "upload when started" */
 	eff->state = FFPL_STARTED;
 	return 0;
@@ -640,7 +1298,7 @@ static int ffpl_stop_effect(struct klgd_plugin_private *priv, struct klgd_comman
 	else
 		cmd = FFPL_SRT_TO_UPL;
 
-	ret = priv->control(dev, s, cmd, data, priv->user);
+	ret = ffpl_control(priv, s, eff, cmd, data);
 	if (ret)
 		return ret;
 	if (cmd == FFPL_SRT_TO_EMP)
@@ -657,7 +1315,6 @@ static int ffpl_stop_effect(struct klgd_plugin_private *priv, struct klgd_comman
 
 static int ffpl_update_effect(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff)
 {
-	struct input_dev *dev = priv->dev;
 	union ffpl_control_data data;
 	int ret;
 
@@ -665,31 +1322,35 @@ static int ffpl_update_effect(struct klgd_plugin_private *priv, struct klgd_comm
 		return ffpl_start_effect(priv, s, eff);
 
 	data.effects.cur = &eff->latest;
-	data.effects.old = NULL;
-	ret = priv->control(dev, s, FFPL_SRT_TO_UDT, data, priv->user);
+	data.effects.old = &eff->active;
+	data.effects.changed = eff->changed;
+	ret = ffpl_control(priv, s, eff, FFPL_SRT_TO_UDT, data);
 	if (ret)
 		return ret;
-	eff->active = eff->latest;
+	ffpl_activate_latest(eff);
 	return 0;
 }
 
 static int ffpl_upload_effect(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff)
 {
+	/* Effects that do not fit into the device are uploaded when they are started */
 	if (!priv->upload_when_started) {
-		struct input_dev *dev = priv->dev;
-		union ffpl_control_data data;
-		int ret;
+		if (ffpl_slot_available(priv, eff)) {
+			union ffpl_control_data data;
+			int ret;
 
-		data.effects.cur = &eff->latest;
-		data.effects.old = NULL;
-		ret = priv->control(dev, s, FFPL_EMP_TO_UPL, data, priv->user);
-		if (ret)
-			return ret;
-		eff->uploaded_to_device = true;
+			data.effects.cur = &eff->latest;
+			data.effects.old = NULL;
+			ret = ffpl_control(priv, s, eff, FFPL_EMP_TO_UPL, data);
+			if (ret)
+				return ret;
+			eff->uploaded_to_device = true;
+		} else
+			priv->uploads_skipped++;
 	}
 
 	eff->state = FFPL_UPLOADED;
-	eff->active = eff->latest;
+	ffpl_activate_latest(eff);
 	return 0;
 }
 
@@ -698,7 +1359,7 @@ static int ffpl_set_autocenter(struct klgd_plugin_private *priv, struct klgd_com
 	union ffpl_control_data data;
 
 	data.autocenter = priv->autocenter;
-	return priv->control(priv->dev, s, FFPL_SET_AUTOCENTER, data, priv->user);
+	return ffpl_control(priv, s, NULL, FFPL_SET_AUTOCENTER, data);
 }
 
 static int ffpl_set_gain(struct klgd_plugin_private *priv, struct klgd_command_stream *s)
@@ -706,38 +1367,41 @@ static int ffpl_set_gain(struct klgd_plugin_private *priv, struct klgd_command_s
 	union ffpl_control_data data;
 
 	data.gain = priv->gain;
-	return priv->control(priv->dev, s, FFPL_SET_GAIN, data, priv->user);
+	return ffpl_control(priv, s, NULL, FFPL_SET_GAIN, data);
 }
 
-static void ffpl_calculate_trip_times(struct ffpl_effect *eff, const unsigned long now)
+static void ffpl_calculate_trip_times(struct ffpl_effect *eff, const ktime_t now)
 {
 	const struct ff_effect *ueff = &eff->latest;
 
-	eff->start_at = now + msecs_to_jiffies(ueff->replay.delay);
+	eff->start_at = ktime_add_ms(now, ueff->replay.delay);
 	eff->updated_at = eff->start_at;
 	eff->touch_at = eff->start_at;
 
 
 	if (ueff->replay.length)
-		eff->stop_at = eff->start_at + msecs_to_jiffies(ueff->replay.length);
+		eff->stop_at = ktime_add_ms(eff->start_at, ueff->replay.length);
 
+	ffpl_compile_envelope(eff);
 }
 
-static void ffpl_update_trip_times(struct ffpl_effect *eff, const unsigned long now)
+static void ffpl_update_trip_times(struct ffpl_effect *eff, const ktime_t now)
 {
 	const struct ff_effect *ueff_la = &eff->latest;
 	const struct ff_effect *ueff_ac = &eff->active;
 
 	/* The effect has a delay which has not expired yet */
-	if (time_after(eff->start_at, now)) {
+	if (ktime_after(eff->start_at, now)) {
 		/* Adjust the time of start */
-		eff->start_at = eff->start_at - msecs_to_jiffies(ueff_ac->replay.delay) + msecs_to_jiffies(ueff_la->replay.delay);
+		eff->start_at = ktime_add_ms(ktime_sub_ms(eff->start_at, ueff_ac->replay.delay), ueff_la->replay.delay);
 		eff->updated_at = eff->start_at;
 		eff->touch_at = eff->start_at;
 	}
 
 	if (ueff_la->replay.length)
-		eff->stop_at = eff->start_at + msecs_to_jiffies(ueff_la->replay.length);
+		eff->stop_at = ktime_add_ms(eff->start_at, ueff_la->replay.length);
+
+	ffpl_compile_envelope(eff);
 }
 
 /* Destroy request - input device is being destroyed */
@@ -746,6 +1410,11 @@ static void ffpl_destroy_rq(struct ff_device *ff)
 	struct klgd_plugin *self = ff->private;
 	struct klgd_plugin_private *priv = self->private;
 
+	kfree(priv->hw_owners);
+	kfree(priv->batch);
+	kfree(priv->rq_ring);
+	kfree(priv->dl_heap);
+	kfree(priv->started_cf);
 	kfree(priv->effects);
 	kfree(priv);
 }
@@ -759,24 +1428,25 @@ static void ffpl_destroy_rq(struct ff_device *ff)
 /*
  * Handle request to erase an effect within KLGDFF
  */
-static void ffpl_erase_handler(struct klgd_plugin_private *priv, const int effect_id)
+static void ffpl_erase_handler(struct klgd_plugin_private *priv, const int effect_id, const ktime_t now)
 {
 	struct ffpl_effect *eff = &priv->effects[effect_id];
 
 	eff->change = FFPL_TO_ERASE;
 	eff->trigger = FFPL_TRIG_NOW;
+	ffpl_arm_trigger(priv, eff, now);
 }
 
 /*
  * Handle request to start or stop an effect within KLGDFF
  */
-static void ffpl_playback_handler(struct klgd_plugin_private *priv, const struct ffpl_request_playback *pb, const unsigned long now)
+static void ffpl_playback_handler(struct klgd_plugin_private *priv, const struct ffpl_request_playback *pb, const ktime_t now)
 {
 	struct ffpl_effect *eff = &priv->effects[pb->effect_id];
 
 	eff->repeat = pb->value;
 	if (pb->value > 0) {
-		if (ffpl_handle_timing(priv, &eff->latest))
+		if (eff->cls_latest.timed)
 			ffpl_calculate_trip_times(eff, now);
 		else
 			eff->start_at = now; /* Start the effect right away and let the device deal with the timing */
@@ -785,41 +1455,59 @@ static void ffpl_playback_handler(struct klgd_plugin_private *priv, const struct
 		eff->change = FFPL_TO_STOP;
 		eff->trigger = FFPL_TRIG_NOW;
 	}
+	ffpl_arm_trigger(priv, eff, now);
 }
 
 /*
  * Handle request to upload an effect within KLGDFF
  */
-static void ffpl_upload_handler(struct klgd_plugin_private *priv, const struct ff_effect *ueff, const unsigned int now)
+static void ffpl_upload_handler(struct klgd_plugin_private *priv, const struct ff_effect *ueff, const ktime_t now)
 {
 	struct ffpl_effect *eff = &priv->effects[ueff->id];
 
 	/* Copy the new effect to the "latest" slot */
 	eff->latest = *ueff;
+	ffpl_classify_effect(priv, ueff, &eff->cls_latest);
+	ffpl_calculate_phase_step(eff);
+	ffpl_compile_envelope(eff);
+	eff->stats.uploads++;
 
 	if (eff->state != FFPL_EMPTY) {
 		if (ffpl_needs_replacing(&eff->active, &eff->latest)) {
+			priv->replacements++;
+			eff->stats.replacements++;
 			eff->replace = true;
 			eff->change = FFPL_TO_UPLOAD;
 			eff->trigger = FFPL_TRIG_NOW;
 		} else {
 			eff->replace = false;
-			if (ffpl_handle_timing(priv, ueff))
+			if (eff->cls_latest.timed)
 				ffpl_update_trip_times(eff, now);
 
 			/* The effect is yet to be started, do not try to update it */
-			if (eff->change == FFPL_TO_START)
+			if (eff->change == FFPL_TO_START) {
+				/* Start time might have changed */
+				if (eff->trigger == FFPL_TRIG_PRELOAD)
+					ffpl_arm_trigger(priv, eff, now);
+				else
+					ffpl_update_index(priv, eff);
 				return;
-			if (eff->state == FFPL_STARTED) {
-				eff->change = FFPL_TO_UPDATE;
-				eff->trigger = FFPL_TRIG_UPDATE;
 			}
-			/* Else: effect is not active, do nothing */
+			if (eff->state != FFPL_STARTED)
+				return; /* Effect is not active, do nothing */
+
+			/* Previous update has not been sent yet, send only the new one */
+			if (eff->change == FFPL_TO_UPDATE)
+				priv->cmds_merged++;
+			eff->changed |= ffpl_changed_fields(&eff->active, &eff->latest);
+			eff->change = FFPL_TO_UPDATE;
+			eff->trigger = FFPL_TRIG_UPDATE;
 		}
 	} else {
 		eff->change = FFPL_TO_UPLOAD;
 		eff->trigger = FFPL_TRIG_NOW;
 	}
+	ffpl_arm_trigger(priv, eff, now);
 }
 
 /*
@@ -834,7 +1522,7 @@ static void ffpl_set_autocenter_handler(struct klgd_plugin_private *priv, const
 /*
  * Handle request for change of gain within KLGDFF
  */
-static void ffpl_set_gain_handler(struct klgd_plugin_private *priv, const u16 gain)
+static void ffpl_set_gain_handler(struct klgd_plugin_private *priv, const u16 gain, const ktime_t now)
 {
 	size_t idx;
 
@@ -849,61 +1537,230 @@ static void ffpl_set_gain_handler(struct klgd_plugin_private *priv, const u16 ga
 		if (eff->state != FFPL_STARTED)
 			continue;
 
-		if (eff->change == FFPL_DONT_TOUCH && eff->trigger != FFPL_TRIG_RECALC) {
-			eff->change = FFPL_TO_UPDATE;
-			eff->trigger = FFPL_TRIG_NOW;
+		/* Driver applies the gain to the level */
+		eff->changed |= FFPL_CHANGED_LEVEL;
+		/* Pending start, stop, update or recalculation stays in place */
+		if (eff->change != FFPL_DONT_TOUCH || eff->trigger != FFPL_TRIG_NONE)
+			continue;
+
+		eff->change = FFPL_TO_UPDATE;
+		eff->trigger = FFPL_TRIG_NOW;
+		ffpl_arm_trigger(priv, eff, now);
+	}
+}
+
+static void ffpl_collapse_request(struct klgd_plugin_private *priv, struct ffpl_request *rq)
+{
+	rq->collapsed = true;
+	priv->rq_collapsed++;
+}
+
+/*
+ * Collapse requests in the ring that are made redundant by newer requests.
+ * - Only the first upload of an effect is kept because it picks up the newest uploaded effect anyway
+ * - Only the last gain and autocenter requests are kept
+ * - A start superseded by another start or a stop of the same effect is dropped
+ * - A stop of an effect that was not playing and was started and stopped within the batch is dropped as well
+ */
+static void ffpl_coalesce_requests(struct klgd_plugin_private *priv)
+{
+	struct ffpl_request *gain = NULL;
+	struct ffpl_request *autocenter = NULL;
+	unsigned int idx;
+
+	for (idx = priv->rq_tail; idx != priv->rq_head; idx++) {
+		struct ffpl_request *rq = &priv->rq_ring[idx & priv->rq_ring_mask];
+		struct ffpl_effect *eff;
+
+		switch (rq->type) {
+		case FFPL_RQ_UPLOAD:
+			eff = &priv->effects[rq->data.effect_id];
+			if (eff->rq_upload)
+				ffpl_collapse_request(priv, rq);
+			else
+				eff->rq_upload = rq;
+			break;
+		case FFPL_RQ_PLAYBACK:
+		{
+			struct ffpl_request *prev;
+
+			eff = &priv->effects[rq->data.pb.effect_id];
+			prev = eff->rq_playback;
+			eff->rq_playback = rq;
+			if (!prev)
+				break;
+
+			if (prev->data.pb.value > 0) {
+				/* Start followed by a start or a stop */
+				ffpl_collapse_request(priv, prev);
+				if (rq->data.pb.value > 0)
+					break;
+				/* Effect that was idle before the batch is left idle */
+				if (eff->state != FFPL_STARTED && eff->trigger == FFPL_TRIG_NONE) {
+					ffpl_collapse_request(priv, rq);
+					eff->rq_playback = NULL;
+				}
+			} else if (rq->data.pb.value <= 0) {
+				/* Stop followed by a stop */
+				ffpl_collapse_request(priv, rq);
+				eff->rq_playback = prev;
+			}
+			break;
 		}
+		case FFPL_RQ_ERASE:
+			eff = &priv->effects[rq->data.effect_id];
+			eff->rq_upload = NULL;
+			eff->rq_playback = NULL;
+			break;
+		case FFPL_RQ_AUTOCENTER:
+			if (autocenter)
+				ffpl_collapse_request(priv, autocenter);
+			autocenter = rq;
+			break;
+		case FFPL_RQ_GAIN:
+			if (gain)
+				ffpl_collapse_request(priv, gain);
+			gain = rq;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Put a latency into its log2 histogram bucket */
+static void ffpl_record_latency(u32 *hist, const ktime_t since, const ktime_t now)
+{
+	/* Effects that are due within the current tick may be processed slightly ahead of time */
+	const u64 us = ktime_after(now, since) ? div_u64(ktime_to_ns(ktime_sub(now, since)), NSEC_PER_USEC) : 0;
+
+	hist[min_t(unsigned int, fls64(us), FFPL_LAT_BUCKETS - 1)]++;
+}
+
+/* Remember the oldest request that has to be processed by ffpl_get_commands() */
+static void ffpl_stamp_request(struct ffpl_effect *eff, const struct ffpl_request *rq, const ktime_t now)
+{
+	ktime_t delay = 0;
+
+	/* Replay delay postpones everything that is pending for the effect, it is not a processing latency */
+	if (rq->type == FFPL_RQ_PLAYBACK && rq->data.pb.value > 0 && ktime_after(eff->start_at, now))
+		delay = ktime_sub(eff->start_at, now);
+
+	if (eff->rq_at) {
+		eff->rq_at = ktime_add(eff->rq_at, delay);
+		return;
 	}
+
+	eff->rq_at = ktime_add(rq->submitted_at, delay);
+	eff->rq_type = rq->type;
+}
+
+/*
+ * Account a trip point that is being processed. KLGD cannot wake us up more often
+ * than once a jiffy and recalculations are spaced by the update period, only
+ * trip points processed later than that are overruns.
+ */
+static void ffpl_record_lateness(struct klgd_plugin_private *priv, const struct ffpl_effect *eff, const ktime_t now)
+{
+	struct ffpl_lateness *l = &priv->lateness[eff->trigger];
+	const u64 ns = ktime_after(now, eff->touch_at) ? ktime_to_ns(ktime_sub(now, eff->touch_at)) : 0;
+
+	if (ns > max_t(u64, priv->update_period, TICK_NSEC))
+		priv->sched_overruns++;
+
+	if (!l->count || ns < l->min)
+		l->min = ns;
+	if (ns > l->max)
+		l->max = ns;
+	l->total += ns;
+	l->count++;
+	ffpl_record_latency(l->hist, eff->touch_at, now);
+}
+
+static void ffpl_record_emit(struct klgd_plugin_private *priv, ktime_t *at, const enum ffpl_request_type type,
+			     const ktime_t now)
+{
+	if (!*at)
+		return;
+
+	ffpl_record_latency(priv->lat_emit[type], *at, now);
+	*at = 0;
 }
 
 /*
  * Here is where we process all queued requests.
  * We take hold of the dev->event_lock spinlock to make
- * sure that the queue is not modified while we are processing it.
- * We always process the whole queue in one shot.
+ * sure that the ring is not modified while we are processing it.
+ * We always drain the whole ring in one shot, collapsing
+ * redundant requests before any of them is handled.
  */
 static void ffpl_request_work(struct work_struct *w)
 {
 	unsigned long flags;
-	struct list_head *p, *n;
 	struct klgd_plugin_private *priv = container_of(w, struct klgd_plugin_private, rqwq_work);
 	struct klgd_plugin *self = priv->self;
-	const unsigned long now = jiffies;
+	const ktime_t now = ktime_get();
 
 	klgd_lock_plugins(self->plugins_lock);
 	spin_lock_irqsave(&priv->dev->event_lock, flags);
 
-	if (list_empty(&priv->rq_list)) {
-		spin_unlock_irqrestore(&priv->dev->event_lock, flags);
-		klgd_unlock_plugins(self->plugins_lock);
-	}
+	trace_klgdff_rq_drain(priv->rq_head - priv->rq_tail, priv->rq_autocenter_latched || priv->rq_gain_latched);
+	ffpl_coalesce_requests(priv);
 
-	list_for_each_safe(p, n, &priv->rq_list) {
-		struct ffpl_request_task *t = list_entry(p, struct ffpl_request_task, rq_list);
-		struct ffpl_request *rq = &t->rq;
+	while (priv->rq_tail != priv->rq_head) {
+		const struct ffpl_request *rq = &priv->rq_ring[priv->rq_tail & priv->rq_ring_mask];
+
+		if (!rq->collapsed)
+			ffpl_record_latency(priv->lat_drain[rq->type], rq->submitted_at, now);
 
 		switch (rq->type) {
 		case FFPL_RQ_UPLOAD:
-			ffpl_upload_handler(priv, &rq->data.upload_effect, now);
+			priv->effects[rq->data.effect_id].rq_upload = NULL;
+			if (!rq->collapsed) {
+				ffpl_upload_handler(priv, &priv->effects[rq->data.effect_id].queued, now);
+				ffpl_stamp_request(&priv->effects[rq->data.effect_id], rq, now);
+			}
 			break;
 		case FFPL_RQ_PLAYBACK:
-			ffpl_playback_handler(priv, &rq->data.pb, now);
+			priv->effects[rq->data.pb.effect_id].rq_playback = NULL;
+			if (!rq->collapsed) {
+				ffpl_playback_handler(priv, &rq->data.pb, now);
+				ffpl_stamp_request(&priv->effects[rq->data.pb.effect_id], rq, now);
+			}
 			break;
 		case FFPL_RQ_ERASE:
-			ffpl_erase_handler(priv, rq->data.effect_id);
+			ffpl_erase_handler(priv, rq->data.effect_id, now);
+			ffpl_stamp_request(&priv->effects[rq->data.effect_id], rq, now);
 			break;
 		case FFPL_RQ_AUTOCENTER:
-			ffpl_set_autocenter_handler(priv, rq->data.autocenter);
+			if (!rq->collapsed) {
+				ffpl_set_autocenter_handler(priv, rq->data.autocenter);
+				if (!priv->rq_autocenter_at)
+					priv->rq_autocenter_at = rq->submitted_at;
+			}
 			break;
 		case FFPL_RQ_GAIN:
-			ffpl_set_gain_handler(priv, rq->data.gain);
+			if (!rq->collapsed) {
+				ffpl_set_gain_handler(priv, rq->data.gain, now);
+				if (!priv->rq_gain_at)
+					priv->rq_gain_at = rq->submitted_at;
+			}
 			break;
 		default:
 			break;
 		}
 
-		list_del(p);
-		kfree(t);
+		priv->rq_tail++;
+	}
+
+	/* Device-wide requests that overflowed the ring are newer than anything in it */
+	if (priv->rq_autocenter_latched) {
+		ffpl_set_autocenter_handler(priv, priv->rq_latched_autocenter);
+		priv->rq_autocenter_latched = false;
+	}
+	if (priv->rq_gain_latched) {
+		ffpl_set_gain_handler(priv, priv->rq_latched_gain, now);
+		priv->rq_gain_latched = false;
 	}
 
 	spin_unlock_irqrestore(&priv->dev->event_lock, flags);
@@ -917,35 +1774,69 @@ static void ffpl_request_work(struct work_struct *w)
  * all requests on a queue and process them later from a workqueue.
  * To keep the order of requests consistent we push all userspace
  * requests on that queue.
+ * The queue is a ring preallocated along with the plugin so that
+ * submitting a request never allocates memory.
+ * When the ring is full, gain and autocenter requests are latched
+ * and applied after the ring is drained, all other requests are
+ * refused with -ENOSPC.
+ */
+
+/*
+ * Reserve an entry in the request ring.
+ * Must be called with dev->event_lock held
+ */
+static struct ffpl_request * ffpl_rq_reserve(struct klgd_plugin_private *priv, const enum ffpl_request_type type)
+{
+	struct ffpl_request *rq;
+
+	if (priv->rq_head - priv->rq_tail > priv->rq_ring_mask) {
+		priv->rq_overflows++;
+		return NULL;
+	}
+
+	rq = &priv->rq_ring[priv->rq_head & priv->rq_ring_mask];
+	rq->type = type;
+	rq->collapsed = false;
+	rq->submitted_at = ktime_get();
+	return rq;
+}
+
+/*
+ * Make a reserved entry visible to the request worker.
+ * Must be called with dev->event_lock held
  */
+static void ffpl_rq_commit(struct klgd_plugin_private *priv)
+{
+	trace_klgdff_rq_submit(&priv->rq_ring[priv->rq_head & priv->rq_ring_mask], priv->rq_head - priv->rq_tail + 1);
+	priv->rq_head++;
+	queue_work(priv->rqwq, &priv->rqwq_work);
+}
 
 /*
  * Request to erase an effect coming from userspace
- * Explicit lock of dev->event_lock is required to keep the priv->rq_list consistent
+ * Explicit lock of dev->event_lock is required to keep the request ring consistent
  */
 static int ffpl_erase_rq(struct input_dev *dev, int effect_id)
 {
 	unsigned long flags;
-	struct ffpl_request_task *t;
+	struct ffpl_request *rq;
 	struct klgd_plugin *self = dev->ff->private;
 	struct klgd_plugin_private *priv = self->private;
-	/*struct ffpl_effect *eff = &priv->effects[effect_id];*/
-
-	printk(KERN_NOTICE "KLGDFF: RQ erase (effect %d)\n", effect_id);
+	int ret = 0;
 
-	t = kmalloc(sizeof(*t), GFP_KERNEL);
-	if (!t)
-		return -ENOMEM;
-
-	t->rq.type = FFPL_RQ_ERASE;
-	t->rq.data.effect_id = effect_id;
+	pr_debug("KLGDFF: RQ erase (effect %d)\n", effect_id);
 
 	spin_lock_irqsave(&dev->event_lock, flags);
-	list_add_tail(&t->rq_list, &priv->rq_list);
-	queue_work(priv->rqwq, &priv->rqwq_work);
+	rq = ffpl_rq_reserve(priv, FFPL_RQ_ERASE);
+	if (rq) {
+		priv->effects[effect_id].queued_valid = false;
+		rq->data.effect_id = effect_id;
+		ffpl_rq_commit(priv);
+	} else
+		ret = -ENOSPC;
 	spin_unlock_irqrestore(&dev->event_lock, flags);
 
-	return 0;
+	return ret;
 }
 
 /*
@@ -954,52 +1845,60 @@ static int ffpl_erase_rq(struct input_dev *dev, int effect_id)
  */
 static int ffpl_playback_rq(struct input_dev *dev, int effect_id, int value)
 {
-	struct ffpl_request_task *t;
+	struct ffpl_request *rq;
 	struct klgd_plugin *self = dev->ff->private;
 	struct klgd_plugin_private *priv = self->private;
 
-	t = kmalloc(sizeof(*t), GFP_ATOMIC);
-	if (!t)
-		return -ENOMEM;
+	rq = ffpl_rq_reserve(priv, FFPL_RQ_PLAYBACK);
+	if (!rq)
+		return -ENOSPC;
 
-	t->rq.type = FFPL_RQ_PLAYBACK;
-	t->rq.data.pb.value = value;
-	t->rq.data.pb.effect_id = effect_id;
-	list_add_tail(&t->rq_list, &priv->rq_list);
-	queue_work(priv->rqwq, &priv->rqwq_work);
+	rq->data.pb.value = value;
+	rq->data.pb.effect_id = effect_id;
+	ffpl_rq_commit(priv);
 
 	return 0;
 }
 
 /*
  * Request to upload or update an effect coming from userspace.
- * Explicit lock of dev->event_lock is required to keep the priv->rq_list consistent
+ * Explicit lock of dev->event_lock is required to keep the request ring consistent
  */
 static int ffpl_upload_rq(struct input_dev *dev, struct ff_effect *effect, struct ff_effect *old)
 {
 	unsigned long flags;
-	struct ffpl_request_task *t;
+	struct ffpl_request *rq;
 	struct klgd_plugin *self = dev->ff->private;
 	struct klgd_plugin_private *priv = self->private;
+	struct ffpl_effect *eff;
+	int ret = 0;
 
-	printk(KERN_NOTICE "KLGDFF: RQ upload (effect %d)\n", effect->id);
+	pr_debug("KLGDFF: RQ upload (effect %d)\n", effect->id);
 
 	if (!ffpl_is_effect_valid(effect))
 		return -EINVAL;
 
-	t = kmalloc(sizeof(*t), GFP_KERNEL);
-	if (!t)
-		return -ENOMEM;
-
-	t->rq.type = FFPL_RQ_UPLOAD;
-	t->rq.data.upload_effect = *effect;
-
 	spin_lock_irqsave(&dev->event_lock, flags);
-	list_add_tail(&t->rq_list, &priv->rq_list);
-	queue_work(priv->rqwq, &priv->rqwq_work);
+	eff = &priv->effects[effect->id];
+	/* Effect is either already uploaded or waiting in the ring, there is nothing to do */
+	if (eff->queued_valid && ffpl_is_same_effect(&eff->queued, effect)) {
+		priv->uploads_dropped++;
+		spin_unlock_irqrestore(&dev->event_lock, flags);
+		return 0;
+	}
+
+	rq = ffpl_rq_reserve(priv, FFPL_RQ_UPLOAD);
+	if (rq) {
+		/* Older pending uploads of the same effect will pick up the new one too */
+		eff->queued = *effect;
+		eff->queued_valid = true;
+		rq->data.effect_id = effect->id;
+		ffpl_rq_commit(priv);
+	} else
+		ret = -ENOSPC;
 	spin_unlock_irqrestore(&dev->event_lock, flags);
 
-	return 0;
+	return ret;
 }
 
 /*
@@ -1008,18 +1907,20 @@ static int ffpl_upload_rq(struct input_dev *dev, struct ff_effect *effect, struc
  */
 static void ffpl_set_autocenter_rq(struct input_dev *dev, u16 autocenter)
 {
-	struct ffpl_request_task *t;
+	struct ffpl_request *rq;
 	struct klgd_plugin *self = dev->ff->private;
 	struct klgd_plugin_private *priv = self->private;
 
-	t = kmalloc(sizeof(*t), GFP_ATOMIC);
-	if (!t)
+	rq = ffpl_rq_reserve(priv, FFPL_RQ_AUTOCENTER);
+	if (!rq) {
+		priv->rq_latched_autocenter = autocenter;
+		priv->rq_autocenter_latched = true;
+		queue_work(priv->rqwq, &priv->rqwq_work);
 		return;
+	}
 
-	t->rq.type = FFPL_RQ_AUTOCENTER;
-	t->rq.data.autocenter = autocenter;
-	list_add_tail(&t->rq_list, &priv->rq_list);
-	queue_work(priv->rqwq, &priv->rqwq_work);
+	rq->data.autocenter = autocenter;
+	ffpl_rq_commit(priv);
 }
 
 /*
@@ -1028,122 +1929,122 @@ static void ffpl_set_autocenter_rq(struct input_dev *dev, u16 autocenter)
  */
 static void ffpl_set_gain_rq(struct input_dev *dev, u16 gain)
 {
-	struct ffpl_request_task *t;
+	struct ffpl_request *rq;
 	struct klgd_plugin *self = dev->ff->private;
 	struct klgd_plugin_private *priv = self->private;
 
-	t = kmalloc(sizeof(*t), GFP_ATOMIC);
-	if (!t)
+	rq = ffpl_rq_reserve(priv, FFPL_RQ_GAIN);
+	if (!rq) {
+		priv->rq_latched_gain = gain;
+		priv->rq_gain_latched = true;
+		queue_work(priv->rqwq, &priv->rqwq_work);
 		return;
+	}
 
-	t->rq.type = FFPL_RQ_GAIN;
-	t->rq.data.gain = gain;
-	list_add_tail(&t->rq_list, &priv->rq_list);
-	queue_work(priv->rqwq, &priv->rqwq_work);
+	rq->data.gain = gain;
+	ffpl_rq_commit(priv);
 }
 
 static void ffpl_deinit(struct klgd_plugin *self)
 {
-	struct list_head *p, *n;
 	struct klgd_plugin_private *priv = self->private;
 
 	flush_workqueue(priv->rqwq);
 	destroy_workqueue(priv->rqwq);
-
-	list_for_each_safe(p, n, &priv->rq_list) {
-		list_del(p);
-		kfree(p);
-	}
+	debugfs_remove_recursive(priv->debugfs);
+	priv->debugfs = NULL;
 
 	printk(KERN_DEBUG "KLGDFF: Deinit complete\n");
 }
 
 static int ffpl_handle_combinable_effects(struct klgd_plugin_private *priv, struct klgd_command_stream *s,
-					  const unsigned long now)
+					  const ktime_t now)
 {
 	size_t idx;
 	bool needs_update_cf = false;
 	bool needs_update_rumble = false;
-	size_t active_effects_cf = 0;
-	size_t active_effects_rumble = 0;
 
-	for (idx = 0; idx < priv->effect_count; idx++) {
+	for_each_set_bit(idx, priv->pending, priv->effect_count) {
 		int ret;
 		struct ffpl_effect *eff = &priv->effects[idx];
 
-		if (time_before(now, eff->touch_at)) {
-			printk(KERN_NOTICE "KLGDFF: Combinable effect is to be processed at a later time, skipping\n");
+		if (!ffpl_is_due(eff, now)) {
+			pr_debug("KLGDFF: Combinable effect is to be processed at a later time, skipping\n");
 			continue;
 		}
 
 		if (eff->replace) {
 			/* Uncombinable effect is about to be replaced by a combinable one */
-			if (ffpl_process_memless(priv, &eff->latest, FFPL_HANDLER_ANY)) {
-				printk(KERN_NOTICE "KLGDFF: Replacing uncombinable with combinable\n");
+			if (eff->cls_latest.handlers) {
+				pr_debug("KLGDFF: Replacing uncombinable with combinable\n");
 				switch (eff->state) {
 				case FFPL_STARTED:
 					ret = ffpl_stop_effect(priv, s, eff);
 					if (ret)
-						return ret;
+						break;
 				default:
 					ret = ffpl_erase_effect(priv, s, eff);
-					if (ret)
-						return ret;
 					break;
 				}
+				if (ret) {
+					ffpl_update_index(priv, eff);
+					return ret;
+				}
 				eff->replace = false;
 			} else {
 			/* Combinable effect is being replaced by an uncombinable one */
-				printk(KERN_NOTICE "KLGDFF: Replacing combinable with uncombinable\n");
+				pr_debug("KLGDFF: Replacing combinable with uncombinable\n");
 				if (eff->state == FFPL_STARTED)
-					NEEDS_UPDATE_SET(eff->active.type);
+					NEEDS_UPDATE_SET(eff->cls_active);
 				eff->state = FFPL_EMPTY;
 				eff->replace = false;
+				ffpl_update_index(priv, eff);
 				continue;
 			}
 		} else {
-			if (!ffpl_process_memless(priv, &eff->latest, FFPL_HANDLER_ANY))
+			if (!eff->cls_latest.handlers)
 				continue;
 		}
 
 		switch (eff->change) {
 		case FFPL_DONT_TOUCH:
 			if (eff->state == FFPL_STARTED) {
-				ACTIVE_EFFECTS_INC(eff->active.type);
 				if (eff->recalculate) {
-					NEEDS_UPDATE_SET(eff->active.type);
+					NEEDS_UPDATE_SET(eff->cls_active);
+					ffpl_mark_dirty(priv, eff);
 					eff->recalculate = false;
-					printk(KERN_NOTICE "KLGDFF: Recalculable combinable effect, total active effects (CF/Rumble) %lu/%lu\n", active_effects_cf, active_effects_rumble);
+					priv->recalculations++;
+					eff->stats.recalculations++;
+					pr_debug("KLGDFF: Recalculable combinable effect\n");
 				}
 			} else
-				printk(KERN_NOTICE "KLGDFF: Unchanged combinable effect, total active effects (CF/Rumble) %lu/%lu\n", active_effects_cf, active_effects_rumble);
+				pr_debug("KLGDFF: Unchanged combinable effect\n");
 			break;
 		case FFPL_TO_START:
 			eff->state = FFPL_STARTED;
 		case FFPL_TO_UPDATE:
-			eff->active = eff->latest;
+			ffpl_activate_latest(eff);
 			if (eff->state != FFPL_STARTED) {
-				printk(KERN_NOTICE "KLGDFF: Updating a stopped combinable effect\n");
+				pr_debug("KLGDFF: Updating a stopped combinable effect\n");
 				break;
 			}
-			ACTIVE_EFFECTS_INC(eff->active.type);
-			NEEDS_UPDATE_SET(eff->active.type);
-			printk(KERN_NOTICE "KLGDFF: %s combinable effect, total active effects (CF/Rumble) %lu/%lu\n", eff->change == FFPL_TO_START ? "Started" : "Altered",
-			       active_effects_cf, active_effects_rumble);
+			NEEDS_UPDATE_SET(eff->cls_active);
+			ffpl_mark_dirty(priv, eff);
+			pr_debug("KLGDFF: %s combinable effect\n", eff->change == FFPL_TO_START ? "Started" : "Altered");
 			break;
 		case FFPL_TO_STOP:
 			if (eff->state == FFPL_STARTED)
-				NEEDS_UPDATE_SET(eff->active.type);
+				NEEDS_UPDATE_SET(eff->cls_active);
 		case FFPL_TO_UPLOAD:
-			eff->active = eff->latest;
+			ffpl_activate_latest(eff);
 			eff->state = FFPL_UPLOADED;
-			printk(KERN_NOTICE "KLGDFF: Combinable effect to upload/stop, marking as uploaded\n");
+			pr_debug("KLGDFF: Combinable effect to upload/stop, marking as uploaded\n");
 			break;
 		case FFPL_TO_ERASE:
 			if (eff->state == FFPL_STARTED)
-				NEEDS_UPDATE_SET(eff->active.type);
+				NEEDS_UPDATE_SET(eff->cls_active);
 			eff->state = FFPL_EMPTY;
-			printk(KERN_NOTICE "KLGDFF: Stopped combinable effect, total active effects (CF/Rumble) %lu/%lu\n", active_effects_cf, active_effects_rumble);
+			pr_debug("KLGDFF: Stopped combinable effect\n");
 			break;
 		default:
 			printk(KERN_WARNING "KLGDFF: Unknown effect change!\n");
@@ -1151,38 +2052,56 @@ static int ffpl_handle_combinable_effects(struct klgd_plugin_private *priv, stru
 		}
 
 		eff->change = FFPL_DONT_TOUCH;
+		ffpl_record_emit(priv, &eff->rq_at, eff->rq_type, now);
+		ffpl_update_index(priv, eff);
 	}
 
 	/* Combined effect needs recalculation */
 	if (needs_update_cf) {
+		const size_t active_effects_cf = bitmap_weight(priv->started_cf, priv->effect_count);
+
 		if (active_effects_cf) {
-			printk(KERN_NOTICE "KLGDFF: Combined constant force effect needs an update, total effects active: %lu\n", active_effects_cf);
+			pr_debug("KLGDFF: Combined constant force effect needs an update, total effects active: %lu\n", active_effects_cf);
 			ffpl_recalc_combined_cf(priv, now);
-			if (priv->combined_effect_cf.state == FFPL_STARTED)
-				priv->combined_effect_cf.change = FFPL_TO_UPDATE;
-			else
+			if (priv->combined_effect_cf.state == FFPL_STARTED) {
+				if (!ffpl_cf_within_deadband(priv)) {
+					if (priv->combined_effect_cf.change == FFPL_TO_UPDATE)
+						priv->cmds_merged++;
+					priv->combined_effect_cf.changed |= ffpl_changed_fields(&priv->combined_effect_cf.active,
+												&priv->combined_effect_cf.latest);
+					priv->combined_effect_cf.change = FFPL_TO_UPDATE;
+				}
+			} else
 				priv->combined_effect_cf.change = FFPL_TO_START;
 		} else {
 			/* No combinable effects are active, remove the effect from device */
 			if (priv->combined_effect_cf.state != FFPL_EMPTY) {
-				printk(KERN_NOTICE "KLGDFF: No combinable constant force effects are active, erase the combined constant force effect from device\n");
+				pr_debug("KLGDFF: No combinable constant force effects are active, erase the combined constant force effect from device\n");
 				priv->combined_effect_cf.change = FFPL_TO_ERASE;
 			}
 		}
 	}
 
 	if (needs_update_rumble) {
+		const size_t active_effects_rumble = bitmap_weight(priv->started_rumble, priv->effect_count);
+
 		if (active_effects_rumble) {
-			printk(KERN_NOTICE "KLGDFF: Combined rumble effect needs an update, total effects active: %lu\n", active_effects_rumble);
+			pr_debug("KLGDFF: Combined rumble effect needs an update, total effects active: %lu\n", active_effects_rumble);
 			ffpl_recalc_combined_rumble(priv, now);
-			if (priv->combined_effect_rumble.state == FFPL_STARTED)
-				priv->combined_effect_rumble.change = FFPL_TO_UPDATE;
-			else
+			if (priv->combined_effect_rumble.state == FFPL_STARTED) {
+				if (!ffpl_rumble_within_deadband(priv)) {
+					if (priv->combined_effect_rumble.change == FFPL_TO_UPDATE)
+						priv->cmds_merged++;
+					priv->combined_effect_rumble.changed |= ffpl_changed_fields(&priv->combined_effect_rumble.active,
+												    &priv->combined_effect_rumble.latest);
+					priv->combined_effect_rumble.change = FFPL_TO_UPDATE;
+				}
+			} else
 				priv->combined_effect_rumble.change = FFPL_TO_START;
 		} else {
 			/* No combinable effects are active, remove the effect from device */
 			if (priv->combined_effect_rumble.state != FFPL_EMPTY) {
-				printk(KERN_NOTICE "KLGDFF: No combinable rumble effects are active, erase the combined effect from device\n");
+				pr_debug("KLGDFF: No combinable rumble effects are active, erase the combined effect from device\n");
 				priv->combined_effect_rumble.change = FFPL_TO_ERASE;
 			}
 		}
@@ -1191,142 +2110,206 @@ static int ffpl_handle_combinable_effects(struct klgd_plugin_private *priv, stru
 	return 0;
 }
 
-static unsigned long ffpl_get_ticking_recalculation_time(const struct ffpl_effect *eff, const unsigned long now)
+/*
+ * Time it takes a level changing by "slope" to deviate by the error tolerance.
+ * Slope is given in Q40 units of level per nanosecond.
+ */
+static u64 ffpl_slope_to_interval(const u16 tolerance, const u64 slope)
+{
+	if (!slope)
+		return FFPL_RECALC_MAX_NSEC;
+
+	return clamp_t(u64, div64_u64((u64)tolerance << FFPL_ENV_SLOPE_SHIFT, slope),
+		       FFPL_RECALC_MIN_NSEC, FFPL_RECALC_MAX_NSEC);
+}
+
+/*
+ * Time it takes a periodic waveform to deviate by the error tolerance.
+ * The magnitude is padded by the tolerance to account for the envelope changing
+ * before the next recalculation. This also limits the interval to a fraction
+ * of the period for waveforms with a negligible magnitude.
+ */
+static u64 ffpl_periodic_to_interval(const u16 tolerance, const struct ffpl_effect *eff, const ktime_t now,
+				     const u32 slope)
+{
+	const u64 period = (u64)eff->active.u.periodic.period * NSEC_PER_MSEC;
+	const u32 magnitude = abs(ffpl_apply_envelope(eff, now)) + tolerance;
+
+	return clamp_t(u64, div64_u64((u64)tolerance * period * 1000, (u64)slope * magnitude),
+		       FFPL_RECALC_MIN_NSEC, FFPL_RECALC_MAX_NSEC);
+}
+
+static ktime_t ffpl_get_ticking_recalculation_time(const struct klgd_plugin_private *priv, const struct ffpl_effect *eff,
+						   const ktime_t now)
 {
 	const struct ff_effect *ueff = &eff->active;
+	const u16 tolerance = READ_ONCE(priv->tolerance);
 
 	switch (ueff->type) {
 	case FF_PERIODIC:
+		if (ueff->u.periodic.waveform == FF_SQUARE)
+			return ktime_add_ms(now, ueff->u.periodic.period / 2);
+		if (!tolerance || !ueff->u.periodic.period)
+			return ktime_add_ns(now, priv->update_period);
+
 		switch (ueff->u.periodic.waveform) {
-		case FF_SQUARE:
-			return now + msecs_to_jiffies(ueff->u.periodic.period / 2);
+		case FF_SINE:
+			return ktime_add_ns(now, ffpl_periodic_to_interval(tolerance, eff, now, FFPL_SLOPE_SINE));
+		case FF_SAW_UP:
+		case FF_SAW_DOWN:
+			return ktime_add_ns(now, ffpl_periodic_to_interval(tolerance, eff, now, FFPL_SLOPE_SAW));
+		case FF_TRIANGLE:
+			return ktime_add_ns(now, ffpl_periodic_to_interval(tolerance, eff, now, FFPL_SLOPE_TRIANGLE));
 		default:
-			return now + msecs_to_jiffies(RECALC_DELTA_T_MSEC);
+			return ktime_add_ns(now, priv->update_period);
 		}
 		break;
 	case FF_RAMP:
-		return now + msecs_to_jiffies(RECALC_DELTA_T_MSEC);
+	{
+		/* Level of a ramp is given by the slope of its envelope segments */
+		const struct ffpl_env_segment *seg = ffpl_get_env_segment(eff, now);
+
+		if (!tolerance || !seg)
+			return ktime_add_ns(now, priv->update_period);
+		return ktime_add_ns(now, ffpl_slope_to_interval(tolerance, abs(seg->slope)));
+	}
+	case FF_RUMBLE:
+		return ktime_add_ns(now, priv->update_period);
 	default:
 		WARN(true, "KLGDFF: Invalid type of effect passed to ticking ticking_recalculation. This cannot happen!\n");
-		return 0;
+		return now;
 	}
 }
 
-static unsigned long ffpl_get_env_recalculation_time(const struct ffpl_effect *eff, const unsigned long now)
+static ktime_t ffpl_get_env_recalculation_time(const struct klgd_plugin_private *priv, const struct ffpl_effect *eff,
+					       const ktime_t now)
 {
-	const struct ff_envelope *env = ffpl_get_envelope(&eff->active);
-	unsigned long t;
+	const struct ffpl_env_segment *seg = ffpl_get_env_segment(eff, now);
+	const u16 tolerance = READ_ONCE(priv->tolerance);
+	ktime_t end;
+	ktime_t t;
 
-	/* Is the envelope attacking */
-	t = eff->start_at + msecs_to_jiffies(env->attack_length); /* Time of the end of the attack */
-	if (time_before_eq(now, t)) {
-		unsigned long st = now + msecs_to_jiffies(RECALC_DELTA_T_MSEC);
-		printk(KERN_NOTICE "KLGDFF: Envelope attacking\n");
-		/* Schedule an update for the end of the attack */
-		if (time_after(st, t))
-			return t;
-		return st;
-	}
+	if (!seg || !seg->length)
+		return ktime_add_ns(now, priv->update_period);
 
-	t = eff->stop_at - msecs_to_jiffies(env->fade_length); /* Time of the beginning of the fade */
-	if (time_before_eq(now, t)) {
-		printk(KERN_NOTICE "KLGDFF: Envelope waiting to fade\n");
-		if (time_after(t, eff->stop_at))
-			return eff->stop_at;
-		return t;	/* Schedule an update for the beginning of the fade */
-	}
+	/* Flat segments need no update until they end */
+	end = ktime_add_ns(seg->begin, seg->length);
+	if (!seg->slope)
+		return end;
 
-	printk(KERN_NOTICE "KLGDFF: Envelope is fading\n");
-	t = now + msecs_to_jiffies(RECALC_DELTA_T_MSEC); /* Continue fading */
-	return (time_after(t, eff->stop_at)) ? eff->stop_at : t;
+	if (tolerance)
+		t = ktime_add_ns(now, ffpl_slope_to_interval(tolerance, abs(seg->slope)));
+	else
+		t = ktime_add_ns(now, priv->update_period);
+	return ktime_after(t, end) ? end : t;
 }
 
-static unsigned long ffpl_get_recalculation_time(const struct klgd_plugin_private *priv, const struct ffpl_effect *eff,
-						 const unsigned long now)
+static ktime_t ffpl_get_recalculation_time(const struct klgd_plugin_private *priv, const struct ffpl_effect *eff,
+					   const ktime_t now)
 {
-	const struct ff_envelope *env = ffpl_get_envelope(&eff->active);
-	const bool ticks = eff->active.type == FF_PERIODIC || eff->active.type == FF_RAMP;
-	bool has_envelope = false;
-
-	if (eff->active.type == FF_RUMBLE && priv->memless_rumble_emul)
-		return now + msecs_to_jiffies(RECALC_DELTA_T_MSEC);
-
-	if (env)
-		has_envelope = env->attack_length || env->fade_length;
+	const struct ffpl_effect_class *cls = &eff->cls_active;
 
-	if (ticks && has_envelope) {
-		const unsigned long t_tick = ffpl_get_ticking_recalculation_time(eff, now);
-		const unsigned long t_env = ffpl_get_env_recalculation_time(eff, now);
+	if (cls->ticks && cls->has_envelope) {
+		const ktime_t t_tick = ffpl_get_ticking_recalculation_time(priv, eff, now);
+		const ktime_t t_env = ffpl_get_env_recalculation_time(priv, eff, now);
 
-		printk(KERN_NOTICE "KLGDFF: Effect has both envelope and ticks\n");
-		return time_before(t_tick, t_env) ? t_tick : t_env;
+		return ktime_before(t_tick, t_env) ? t_tick : t_env;
 	}
-	if (ticks)
-		return ffpl_get_ticking_recalculation_time(eff, now);
-	if (!has_envelope) {
+	if (cls->ticks)
+		return ffpl_get_ticking_recalculation_time(priv, eff, now);
+	if (!cls->has_envelope) {
 		WARN(true, "KLGDFF: Effect does not have to be recalculated but ffpl_get_recalculation_time() was called\n");
 		return now;
 	}
 
-	return ffpl_get_env_recalculation_time(eff, now);
+	return ffpl_get_env_recalculation_time(priv, eff, now);
 }
 
-static bool ffpl_needs_recalculation(const struct klgd_plugin_private *priv, const struct ff_effect *ueff, const unsigned long start_at,
-				     const unsigned long stop_at, const unsigned long now)
+static bool ffpl_needs_recalculation(const struct ff_effect *ueff, const struct ffpl_effect_class *cls,
+				     const ktime_t start_at, const ktime_t stop_at, const ktime_t now)
 {
-	const struct ff_envelope *env = ffpl_get_envelope(ueff);
-	bool ticks = ueff->type == FF_PERIODIC || ueff->type == FF_RAMP;
-
-	if (time_before(now, start_at)) {
-		printk(KERN_NOTICE "KLGDFF: Effect has not started yet\n");
+	if (ktime_before(now, start_at))
 		return false;
-	}
 
 	/* Only effects handled by memless mode can be periodically reprocessed */
-	if (!ffpl_process_memless(priv, ueff, FFPL_HANDLER_ANY)) {
-		printk(KERN_NOTICE "KLGDFF: Effect not combinable, won't recalculate\n");
+	if (!cls->handlers)
 		return false;
-	}
 
-	/* Emulated rumble effect needs to be recalculated under all circuumstances */
-	if (ueff->type == FF_RUMBLE && priv->memless_rumble_emul && !(ueff->replay.length && time_after_eq(now, stop_at)))
-		return true;
+	if (!cls->ticks) {
+		const struct ff_envelope *env = ffpl_get_envelope(ueff);
 
-	if (!env) {
-		printk(KERN_NOTICE "KLGDFF: Effect type does not support envelope, no need to recalculate\n");
-		return false;
+		if (!cls->has_envelope)
+			return false;
+		/* Envelope has finished attacking and it does not fade */
+		if (!env->fade_length && !ktime_before(now, ktime_add_ms(start_at, env->attack_length)))
+			return false;
 	}
 
-	if (!env->attack_length && !env->fade_length && !ticks) {
-		printk(KERN_NOTICE "KLGDFF: Effect has no envelope and does not tick, no need to recalculate\n");
+	/* Effect is done and shall be stopped.
+	 * Stopping of the effect is handled elsewhere */
+	if (ueff->replay.length && !ktime_before(now, stop_at))
 		return false;
-	}
 
-	if (!env->fade_length && time_after_eq(now, msecs_to_jiffies(env->attack_length) + start_at) && !ticks) {
-		printk(KERN_NOTICE "KLGDFF: Envelope has finished attacking, it does not fade and it does not tick, no need to recalculate\n");
-		return false;
-	}
+	return true;
+}
 
-	/* Effect is done fading and shall be stopped.
-	 * Stopping of the effect is handled elsewhere */
-	if (ueff->replay.length && time_after_eq(now, stop_at)) {
-		printk(KERN_NOTICE "KLGDFF: Effect has finished, no need to recalculate\n");
+/* How long ahead of the start a delayed effect has to be uploaded */
+static u64 ffpl_preload_lead(const struct klgd_plugin_private *priv)
+{
+	/* KLGD wakes us up at jiffy granularity, give the upload at least one tick */
+	return TICK_NSEC + FFPL_PRELOAD_LEAD_FACTOR * priv->upload_latency;
+}
+
+/*
+ * Preloading pays off only if the delay leaves enough time for the upload
+ * and the effect does not push another one out of the device.
+ */
+static bool ffpl_should_preload(const struct klgd_plugin_private *priv, const struct ffpl_effect *eff, const ktime_t now)
+{
+	if (!priv->preload_delayed || eff->cls_latest.handlers)
+		return false;
+	if (eff->state == FFPL_STARTED || eff->uploaded_to_device || eff->replace)
+		return false;
+	if (!ffpl_slot_available(priv, eff))
 		return false;
-	}
 
-	printk(KERN_NOTICE "KLGDFF: Effect needs recalculation\n");
-	return true;
+	return ktime_to_ns(ktime_sub(eff->start_at, now)) > ffpl_preload_lead(priv);
 }
 
-static void ffpl_advance_trigger(const struct klgd_plugin_private *priv, struct ffpl_effect *eff, const unsigned long now)
+static int ffpl_preload_effect(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff)
+{
+	union ffpl_control_data data;
+	int ret;
+
+	/* Things might have changed since the preload was scheduled */
+	if (eff->uploaded_to_device || !ffpl_slot_available(priv, eff))
+		return 0;
+
+	/* Effect that has not been uploaded yet is taken directly from userspace */
+	data.effects.cur = (eff->state == FFPL_EMPTY) ? &eff->latest : &eff->active;
+	data.effects.old = NULL;
+	ret = ffpl_control(priv, s, eff, FFPL_EMP_TO_UPL, data);
+	if (ret)
+		return ret;
+
+	if (eff->state == FFPL_EMPTY) {
+		ffpl_activate_latest(eff);
+		eff->state = FFPL_UPLOADED;
+	}
+	eff->uploaded_to_device = true;
+	priv->preloads++;
+	return 0;
+}
+
+static void ffpl_advance_trigger(struct klgd_plugin_private *priv, struct ffpl_effect *eff, const ktime_t now)
 {
 	switch (eff->trigger) {
 	case FFPL_TRIG_START:
-		if (ffpl_needs_recalculation(priv, &eff->latest, eff->start_at, eff->stop_at, now)) {
+		if (ffpl_needs_recalculation(&eff->latest, &eff->cls_latest, eff->start_at, eff->stop_at, now)) {
 			eff->trigger = FFPL_TRIG_RECALC;
 			break;
 		}
-		if (eff->latest.replay.length && ffpl_handle_timing(priv, &eff->latest))
+		if (eff->latest.replay.length && eff->cls_latest.timed)
 			eff->trigger = FFPL_TRIG_STOP;
 		else
 			eff->trigger = FFPL_TRIG_NONE;
@@ -1334,17 +2317,20 @@ static void ffpl_advance_trigger(const struct klgd_plugin_private *priv, struct
 	case FFPL_TRIG_RESTART:
 		eff->trigger = FFPL_TRIG_STOP;
 		break;
+	case FFPL_TRIG_PRELOAD:
+		eff->trigger = FFPL_TRIG_START;
+		break;
 	case FFPL_TRIG_RECALC:
-		if (ffpl_needs_recalculation(priv, &eff->active, eff->start_at, eff->stop_at, now))
+		if (ffpl_needs_recalculation(&eff->active, &eff->cls_active, eff->start_at, eff->stop_at, now))
 			break;
-		if (eff->active.replay.length && ffpl_process_memless(priv, &eff->active, FFPL_HANDLER_ANY)) {
+		if (eff->active.replay.length && eff->cls_active.handlers) {
 			eff->trigger = FFPL_TRIG_STOP;
 			break;
 		}
 		eff->trigger = FFPL_TRIG_NONE;
 		break;
 	case FFPL_TRIG_STOP:
-		if (eff->repeat > 0 && ffpl_handle_timing(priv, &eff->active)) {
+		if (eff->repeat > 0 && eff->cls_active.timed) {
 			eff->trigger = FFPL_TRIG_RESTART;
 			break;
 		}
@@ -1352,8 +2338,10 @@ static void ffpl_advance_trigger(const struct klgd_plugin_private *priv, struct
 		eff->trigger = FFPL_TRIG_NONE;
 		break;
 	case FFPL_TRIG_UPDATE:
-		if (ffpl_needs_recalculation(priv, &eff->active, eff->start_at, eff->stop_at, now) && eff->state == FFPL_STARTED)
+		if (ffpl_needs_recalculation(&eff->active, &eff->cls_active, eff->start_at, eff->stop_at, now) && eff->state == FFPL_STARTED)
 			eff->trigger = FFPL_TRIG_RECALC;
+		else if (eff->state == FFPL_STARTED && eff->active.replay.length && eff->cls_active.timed)
+			eff->trigger = FFPL_TRIG_STOP; /* Updated effect still has to be stopped */
 		else
 			eff->trigger = FFPL_TRIG_NONE;
 		break;
@@ -1362,144 +2350,584 @@ static void ffpl_advance_trigger(const struct klgd_plugin_private *priv, struct
 	}
 }
 
-static int ffpl_get_commands(struct klgd_plugin *self, struct klgd_command_stream **s, const unsigned long now)
+/*
+ * Process a pending change of a combined effect. When no device slot is free
+ * for it the change is kept and retried after one update period.
+ */
+static int ffpl_handle_combined_state_change(struct klgd_plugin_private *priv, struct klgd_command_stream *s,
+					     struct ffpl_effect *eff, const ktime_t now)
+{
+	const enum ffpl_st_change change = eff->change;
+	int ret;
+
+	priv->slot_exhausted = false;
+	ret = ffpl_handle_state_change(priv, s, eff, now);
+	if (ret && priv->slot_exhausted) {
+		pr_debug("KLGDFF: No device slot is available for combined effect\n");
+		eff->change = change;
+		priv->slot_retry_at = ktime_add_ns(now, priv->update_period);
+		return 0;
+	}
+	return ret;
+}
+
+static int ffpl_get_commands(struct klgd_plugin *self, struct klgd_command_stream **s, const unsigned long now_jiffies)
+{
+	struct klgd_plugin_private *priv = self->private;
+	const ktime_t now = ktime_get();
+	size_t idx;
+	int ret;
+
+	*s = klgd_alloc_stream();
+	if (!*s)
+		return -EAGAIN;
+
+	ffpl_refill_budget(priv, now);
+	if (priv->change_autocenter) {
+		ret = ffpl_set_autocenter(priv, *s);
+		if (ret)
+			goto out;
+		priv->change_autocenter = false;
+		ffpl_record_emit(priv, &priv->rq_autocenter_at, FFPL_RQ_AUTOCENTER, now);
+	}
+	if (priv->change_gain) {
+		ret = ffpl_set_gain(priv, *s);
+		if (ret)
+			goto out;
+		priv->change_gain = false;
+		ffpl_record_emit(priv, &priv->rq_gain_at, FFPL_RQ_GAIN, now);
+	}
+
+	priv->slot_retry_at = 0;
+	ret = ffpl_handle_combinable_effects(priv, *s, now);
+	if (ret) {
+		printk(KERN_WARNING "KLGDFF: Cannot process combinable effects, ret %d\n", ret);
+		goto out;
+	}
+
+	/* Handle combined constant force effect here */
+	if (ffpl_defer_update(priv, &priv->combined_effect_cf)) {
+		pr_debug("KLGDFF: Command budget exhausted, deferring update of combined constant force effect\n");
+	} else {
+		ret = ffpl_handle_combined_state_change(priv, *s, &priv->combined_effect_cf, now);
+		if (ret) {
+			printk(KERN_WARNING "KLGDFF: Cannot get command stream for combined constant force effect\n");
+			goto out;
+		}
+	}
+
+	if (ffpl_defer_update(priv, &priv->combined_effect_rumble)) {
+		pr_debug("KLGDFF: Command budget exhausted, deferring update of combined rumble effect\n");
+	} else {
+		ret = ffpl_handle_combined_state_change(priv, *s, &priv->combined_effect_rumble, now);
+		if (ret) {
+			printk(KERN_WARNING "KLGDFF: Cannot get command stream for combined rumble effect\n");
+			goto out;
+		}
+	}
+
+	for_each_set_bit(idx, priv->pending, priv->effect_count) {
+		struct ffpl_effect *eff = &priv->effects[idx];
+		enum ffpl_st_change change;
+
+		pr_debug("KLGDFF: Processing effect %lu\n", idx);
+
+		if (!ffpl_is_due(eff, now)) {
+			pr_debug("KLGDFF: Next change of the effect is schededuled for the future\n");
+			continue;
+		}
+
+		if (ffpl_defer_update(priv, eff)) {
+			pr_debug("KLGDFF: Command budget exhausted, deferring update of effect %lu\n", idx);
+			eff->touch_at = priv->budget_reset_at;
+			ffpl_update_index(priv, eff);
+			continue;
+		}
+		ffpl_record_lateness(priv, eff, now);
+
+		if (eff->trigger == FFPL_TRIG_PRELOAD) {
+			ret = ffpl_preload_effect(priv, *s, eff);
+			if (ret) {
+				printk(KERN_WARNING "KLGDFF: Cannot preload effect %lu\n", idx);
+				goto out;
+			}
+			ffpl_advance_trigger(priv, eff, now);
+			ffpl_arm_trigger(priv, eff, now);
+			continue;
+		}
+
+		change = eff->change;
+		priv->slot_exhausted = false;
+		ret = ffpl_handle_state_change(priv, *s, eff, now);
+		if (ret && priv->slot_exhausted) {
+			/* All device slots are taken by playing effects, try again later */
+			pr_debug("KLGDFF: No device slot is available for effect %lu\n", idx);
+			eff->change = change;
+			eff->touch_at = ktime_add_ns(now, priv->update_period);
+			ffpl_update_index(priv, eff);
+			ret = 0;
+			continue;
+		}
+		if (ret) {
+			printk(KERN_WARNING "KLGDFF: Cannot get command stream for effect %lu\n", idx);
+			ffpl_update_index(priv, eff);
+			goto out;
+		}
+		ffpl_record_emit(priv, &eff->rq_at, eff->rq_type, now);
+
+		ffpl_advance_trigger(priv, eff, now);
+		ffpl_arm_trigger(priv, eff, now);
+	}
+
+out:
+	if (priv->batch_count) {
+		const int bret = ffpl_flush_batch(priv, *s);
+
+		if (!ret)
+			ret = bret;
+	}
+	return ret;
+}
+
+/*
+ * Schedule the next timing trip point of an effect according to its trigger
+ * and put the effect to the right place in the deadline heap.
+ * Must be called whenever the trigger of an effect is changed.
+ */
+static void ffpl_arm_trigger(struct klgd_plugin_private *priv, struct ffpl_effect *eff, const ktime_t now)
+{
+	switch (eff->trigger) {
+	case FFPL_TRIG_NOW:
+	case FFPL_TRIG_UPDATE:
+		eff->touch_at = now;
+		break;
+	case FFPL_TRIG_RESTART:
+		ffpl_calculate_trip_times(eff, now);
+	case FFPL_TRIG_PRELOAD:
+	case FFPL_TRIG_START:
+		if (eff->trigger == FFPL_TRIG_PRELOAD)
+			eff->trigger = FFPL_TRIG_START;
+		eff->touch_at = eff->start_at;
+		eff->phase = 0;
+		eff->change = FFPL_TO_START;
+		if (ffpl_should_preload(priv, eff, now)) {
+			eff->trigger = FFPL_TRIG_PRELOAD;
+			eff->touch_at = ktime_sub_ns(eff->start_at, ffpl_preload_lead(priv));
+		}
+		break;
+	case FFPL_TRIG_STOP:
+		/* Small processing delays might make us to miss the precise stop point */
+		eff->touch_at = ktime_before(eff->stop_at, now) ? now : eff->stop_at;
+		eff->change = FFPL_TO_STOP;
+		eff->repeat--;
+		break;
+	case FFPL_TRIG_RECALC:
+		eff->touch_at = ffpl_get_recalculation_time(priv, eff, now);
+		eff->recalculate = true;
+		break;
+	default:
+		break;
+	}
+
+	ffpl_update_index(priv, eff);
+}
+
+static bool ffpl_get_update_time(struct klgd_plugin *self, const unsigned long now_jiffies, unsigned long *t)
+{
+	struct klgd_plugin_private *priv = self->private;
+	const ktime_t now = ktime_get();
+	/* Updates of combined effects postponed by the command budget */
+	const bool deferred = priv->combined_effect_cf.change == FFPL_TO_UPDATE ||
+			      priv->combined_effect_rumble.change == FFPL_TO_UPDATE;
+	ktime_t next = 0;
+	s64 delta;
+
+	/* Handle device-wide changes first */
+	if (priv->change_gain || priv->change_autocenter) {
+		*t = now_jiffies;
+		return true;
+	}
+
+	/* Nearest trip point is on top of the deadline heap */
+	if (priv->dl_count)
+		next = priv->effects[priv->dl_heap[0]].touch_at;
+
+	if (deferred && (!priv->dl_count || ktime_before(priv->budget_reset_at, next)))
+		next = priv->budget_reset_at;
+	else if (!priv->dl_count && !priv->slot_retry_at)
+		return false;
+
+	/* Combined effects waiting for a device slot */
+	if (priv->slot_retry_at && ((!priv->dl_count && !deferred) || ktime_before(priv->slot_retry_at, next)))
+		next = priv->slot_retry_at;
+
+	delta = max_t(s64, ktime_to_ns(ktime_sub(next, now)), 0);
+
+	/* KLGD schedules in jiffies, round up so that the trip point is not missed */
+	*t = now_jiffies + DIV_ROUND_UP_ULL(delta, TICK_NSEC);
+	return true;
+}
+
+#ifdef FFPL_BENCHMARK
+#define FFPL_BENCH_ITERATIONS 10000
+
+/* Keeps the compiler from optimizing the benchmarked lookups away */
+static volatile unsigned long ffpl_bench_sink;
+
+static u32 ffpl_bench_rand(u32 *seed)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return *seed;
+}
+
+/*
+ * Compare the linear scan over all effects with the deadline heap.
+ * One iteration moves the trip point of a random effect and reads the nearest deadline.
+ * Average cost of one iteration in nanoseconds is stored in scan_ns and heap_ns.
+ */
+static int ffpl_bench_deadlines_one(const size_t effect_count, u64 *scan_ns, u64 *heap_ns)
+{
+	struct klgd_plugin_private *priv;
+	const ktime_t now = ktime_get();
+	ktime_t earliest = 0;
+	u32 seed = 0x8807;
+	u64 start;
+	size_t idx;
+	int ret = 0;
+	int i;
+
+	priv = kzalloc(sizeof(struct klgd_plugin_private), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+	priv->effect_count = effect_count;
+	priv->effects = kcalloc(effect_count, sizeof(struct ffpl_effect), GFP_KERNEL);
+	priv->dl_heap = kcalloc(effect_count, sizeof(unsigned int), GFP_KERNEL);
+	if (!priv->effects || !priv->dl_heap) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (idx = 0; idx < effect_count; idx++) {
+		priv->effects[idx].trigger = FFPL_TRIG_RECALC;
+		priv->effects[idx].touch_at = ktime_add_us(now, ffpl_bench_rand(&seed) % 1000000);
+		ffpl_dl_insert(priv, idx);
+	}
+
+	start = ktime_get_ns();
+	for (i = 0; i < FFPL_BENCH_ITERATIONS; i++) {
+		bool first = true;
+
+		idx = ffpl_bench_rand(&seed) % effect_count;
+		priv->effects[idx].touch_at = ktime_add_us(now, ffpl_bench_rand(&seed) % 1000000);
+
+		for (idx = 0; idx < effect_count; idx++) {
+			const struct ffpl_effect *eff = &priv->effects[idx];
+
+			if (eff->trigger == FFPL_TRIG_NONE)
+				continue;
+			if (first || ktime_before(eff->touch_at, earliest)) {
+				earliest = eff->touch_at;
+				first = false;
+			}
+		}
+		ffpl_bench_sink = ktime_to_ns(earliest);
+	}
+	*scan_ns = div_u64(ktime_get_ns() - start, FFPL_BENCH_ITERATIONS);
+
+	start = ktime_get_ns();
+	for (i = 0; i < FFPL_BENCH_ITERATIONS; i++) {
+		idx = ffpl_bench_rand(&seed) % effect_count;
+		priv->effects[idx].touch_at = ktime_add_us(now, ffpl_bench_rand(&seed) % 1000000);
+		ffpl_dl_update(priv, priv->effects[idx].dl_pos);
+
+		ffpl_bench_sink = ktime_to_ns(priv->effects[priv->dl_heap[0]].touch_at);
+	}
+	*heap_ns = div_u64(ktime_get_ns() - start, FFPL_BENCH_ITERATIONS);
+
+out:
+	kfree(priv->dl_heap);
+	kfree(priv->effects);
+	kfree(priv);
+	return ret;
+}
+
+/* Run the deadline lookup benchmark and print the results into a sysfs buffer */
+ssize_t ffpl_bench_deadlines(char *buf)
+{
+	static const size_t slots[] = { 16, 256, 4096 };
+	ssize_t len;
+	size_t idx;
+
+	len = scnprintf(buf, PAGE_SIZE, "slots scan_ns heap_ns\n");
+	for (idx = 0; idx < ARRAY_SIZE(slots); idx++) {
+		u64 scan_ns, heap_ns;
+		int ret = ffpl_bench_deadlines_one(slots[idx], &scan_ns, &heap_ns);
+
+		if (ret)
+			return ret;
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%zu %llu %llu\n", slots[idx], scan_ns, heap_ns);
+	}
+
+	return len;
+}
+EXPORT_SYMBOL_GPL(ffpl_bench_deadlines);
+
+/* Previous implementation of ffpl_lvl_dir_to_x_y() without logging */
+static void ffpl_bench_lvl_dir_to_x_y_deg(const s32 level, const u16 direction, s32 *x, s32 *y)
+{
+	const int degrees = direction * 360 / 0xFFFF;
+
+	*x = (level * -fixp_sin16(degrees)) >> FRAC_16;
+	*y = (level * -fixp_cos16(degrees)) >> FRAC_16;
+}
+
+/*
+ * Reference sine scaled to 0x7fff, evaluated as a Taylor series in Q30.
+ * Accurate to well below one LSB of the result.
+ */
+static s32 ffpl_bench_sin_ref(const u16 direction)
 {
-	struct klgd_plugin_private *priv = self->private;
-	size_t idx;
-	int ret;
+	const unsigned int quadrant = direction >> 14;
+	unsigned int offset = direction & 0x3fff;
+	s64 x, x2, r;
+
+	if (quadrant & 1)
+		offset = 0x4000 - offset;
+	x = ((s64)offset * 1686629713LL) >> 14; /* offset * pi/2 in Q30 */
+	x2 = (x * x) >> 30;
+
+	r = (1LL << 30) - div_s64(x2, 110);
+	r = (1LL << 30) - div_s64((x2 * r) >> 30, 72);
+	r = (1LL << 30) - div_s64((x2 * r) >> 30, 42);
+	r = (1LL << 30) - div_s64((x2 * r) >> 30, 20);
+	r = (1LL << 30) - div_s64((x2 * r) >> 30, 6);
+	r = (x * r) >> 30;
+	r = (r * 0x7fff + (1LL << 29)) >> 30;
+
+	return (quadrant & 2) ? -r : r;
+}
 
-	*s = klgd_alloc_stream();
-	if (!s)
-		return -EAGAIN;
+static void ffpl_bench_directions_one(void (*fn)(const s32 level, const u16 direction, s32 *x, s32 *y),
+				      u32 *max_err, u64 *ps)
+{
+	u64 start;
+	u32 dir;
 
-	if (priv->change_autocenter) {
-		ret = ffpl_set_autocenter(priv, *s);
-		if (ret)
-			goto out;
-		priv->change_autocenter = false;
-	}
-	if (priv->change_gain) {
-		ret = ffpl_set_gain(priv, *s);
-		if (ret)
-			goto out;
-		priv->change_gain = false;
-	}
+	*max_err = 0;
+	for (dir = 0; dir <= 0xffff; dir++) {
+		const s32 ref_x = -ffpl_bench_sin_ref(dir);
+		const s32 ref_y = -ffpl_bench_sin_ref(dir + 0x4000);
+		s32 x, y;
 
-	ret = ffpl_handle_combinable_effects(priv, *s, now);
-	if (ret) {
-		printk(KERN_WARNING "KLGDFF: Cannot process combinable effects, ret %d\n", ret);
-		goto out;
+		fn(0x8000, dir, &x, &y);
+		*max_err = max_t(u32, *max_err, abs(x - ref_x));
+		*max_err = max_t(u32, *max_err, abs(y - ref_y));
 	}
 
-	/* Handle combined constant force effect here */
-	printk(KERN_NOTICE "KLGDFF: Combined CF: ");
-	ret = ffpl_handle_state_change(priv, *s, &priv->combined_effect_cf, now);
-	if (ret) {
-		printk(KERN_WARNING "KLGDFF: Cannot get command stream for combined constant force effect\n");
-		goto out;
-	}
+	start = ktime_get_ns();
+	for (dir = 0; dir <= 0xffff; dir++) {
+		s32 x, y;
 
-	printk(KERN_NOTICE "KLGDFF: Combined Rumble: ");
-	ret = ffpl_handle_state_change(priv, *s, &priv->combined_effect_rumble, now);
-	if (ret) {
-		printk(KERN_WARNING "KLGDFF: Cannot get command stream for combined rumble effect\n");
-		goto out;
+		fn(0x7fff, dir, &x, &y);
+		ffpl_bench_sink = x + y;
 	}
+	*ps = div_u64((ktime_get_ns() - start) * 1000, 0x10000);
+}
 
-	for (idx = 0; idx < priv->effect_count; idx++) {
-		struct ffpl_effect *eff = &priv->effects[idx];
+/*
+ * Compare the direction lookup table with the previous per-degree implementation.
+ * Errors are the largest deviation of x or y for level 0x8000 from the exact value,
+ * timing is the average cost of one call in picoseconds.
+ */
+ssize_t ffpl_bench_directions(char *buf)
+{
+	u32 err_deg, err_tab;
+	u64 ps_deg, ps_tab;
 
-		printk(KERN_NOTICE "KLGDFF: Processing effect %lu\n", idx);
+	ffpl_bench_directions_one(ffpl_bench_lvl_dir_to_x_y_deg, &err_deg, &ps_deg);
+	ffpl_bench_directions_one(ffpl_lvl_dir_to_x_y, &err_tab, &ps_tab);
 
-		if (time_before(now, eff->touch_at)) {
-			printk(KERN_NOTICE "KLGDFF: Next change of the effect is schededuled for the future\n");
-			continue;
-		}
+	return scnprintf(buf, PAGE_SIZE, "impl max_err ps_per_call\ndegrees %u %llu\ntable %u %llu\n",
+			 err_deg, ps_deg, err_tab, ps_tab);
+}
+EXPORT_SYMBOL_GPL(ffpl_bench_directions);
 
-		ret = ffpl_handle_state_change(priv, *s, eff, now);
-		/* TODO: Do something useful with the return code */
-		if (ret) {
-			printk(KERN_WARNING "KLGDFF: Cannot get command stream for effect %lu\n", idx);
-			goto out;
+/* Previous implementation of ffpl_x_y_to_lvl_dir() */
+static u16 ffpl_bench_atan_int_octet(const u16 x, const u16 y)
+{
+	u32 result;
+
+	if (!y)
+		return 0x0000;
+
+	/* 3rd order polynomial approximation beween 0 <= y/x <= 1 */
+	result = y * 0x02e2 / x;
+	result = y * (0x05dc + result) / x;
+	result = y * (0x28be - result) / x;
+
+	return result;
+}
+
+static u16 ffpl_bench_atan_int_quarter(const u16 x, const u16 y)
+{
+	if (x == y)
+		return 0x2000;
+	else if (x > y)
+		return ffpl_bench_atan_int_octet(x, y);
+	else
+		return 0x4000 - ffpl_bench_atan_int_octet(y, x);
+}
+static void ffpl_bench_x_y_to_lvl_dir_poly(const s32 x, const s32 y, s16 *level, u16 *direction)
+{
+	u16 angle;
+	unsigned long pwr;
+	u32 _x = abs(x);
+	u32 _y = abs(y);
+
+	if (abs(x) > 0xffff || abs(y) > 0xffff) {
+		u32 div;
+		u32 divx = _x / 0xfffe;
+		u32 divy = _y / 0xfffe;
+
+		div = (divx > divy) ? divx : divy;
+
+		_x /= div;
+		_y /= div;
+
+		if (_x > 0xffff || _y > 0xffff) {
+			_x >>= 1;
+			_y >>= 1;
 		}
+	}
+	angle = (!_x && !_y) ? 0x4000 : ffpl_bench_atan_int_quarter(_x, _y);
 
-		ffpl_advance_trigger(priv, eff, now);
+	if (x >= 0 && y >= 0)
+		*direction = 0xC000 - angle;
+	else if (x < 0 && y >= 0)
+		*direction = 0x4000 + angle;
+	else if (x < 0 && y < 0)
+		*direction = 0x4000 - angle;
+	else if (x > 0 && y < 0)
+		*direction = 0xC000 + angle;
+	else
+		*direction = 0x0000;
+
+	if (abs(x) > 0x7fff || abs(y) > 0x7fff) {
+		*level = 0x7fff;
+		return;
 	}
 
-out:
-	return ret;
+	pwr = int_sqrt(x * x + y * y);
+	*level = (pwr > 0x7fff) ? 0x7fff : pwr;
 }
 
-static bool ffpl_get_update_time(struct klgd_plugin *self, const unsigned long now, unsigned long *t)
+#define FFPL_BENCH_VECTORS 1024
+
+struct ffpl_bench_vector {
+	s32 x;
+	s32 y;
+	u16 direction;
+	s32 level;
+};
+
+/*
+ * Vectors of known magnitude and direction.
+ * Coordinates are rounded from the exact values, for the smallest level
+ * this alone accounts for about one LSB of angular error.
+ * Every other vector lies exactly on a multiple of 1/32 of the circle,
+ * which includes the diagonals where the CORDIC result grows the most.
+ */
+static void ffpl_bench_make_vectors(struct ffpl_bench_vector *vecs, const s32 level)
 {
-	struct klgd_plugin_private *priv = self->private;
 	size_t idx;
-	unsigned long events = 0;
 
-	/* Handle device-wide changes first */
-	if (priv->change_gain || priv->change_autocenter) {
-		*t = now;
-		return true;
+	for (idx = 0; idx < FFPL_BENCH_VECTORS; idx++) {
+		struct ffpl_bench_vector *v = &vecs[idx];
+		const u16 dir = idx & 1 ? idx * (0x10000 / FFPL_BENCH_VECTORS) + idx % 61 : (idx % 32) * 0x800;
+
+		v->direction = dir;
+		v->level = level;
+		v->x = -div_s64((s64)level * ffpl_bench_sin_ref(dir), 0x7fff);
+		v->y = -div_s64((s64)level * ffpl_bench_sin_ref(dir + 0x4000), 0x7fff);
 	}
+}
 
-	for (idx = 0; idx < priv->effect_count; idx++) {
-		unsigned long current_t;
-		struct ffpl_effect *eff = &priv->effects[idx];
+static void ffpl_bench_vectors_one(void (*fn)(const s32 x, const s32 y, s16 *level, u16 *direction),
+				   const struct ffpl_bench_vector *vecs, u32 *dir_err, u32 *lvl_err, u64 *cycles)
+{
+	cycles_t start;
+	size_t idx;
+	int i;
 
-		switch (eff->trigger) {
-		case FFPL_TRIG_NOW:
-		case FFPL_TRIG_UPDATE:
-			current_t = now;
-			break;
-		case FFPL_TRIG_RESTART:
-			ffpl_calculate_trip_times(eff, now);
-		case FFPL_TRIG_START:
-			current_t = eff->start_at;
-			eff->playback_time = 0;
-			eff->change = FFPL_TO_START;
-			break;
-		case FFPL_TRIG_STOP:
-			/* Small processing delays might make us to miss the precise stop point */
-			current_t = time_before(eff->stop_at, now) ? now : eff->stop_at;
-			eff->change = FFPL_TO_STOP;
-			eff->repeat--;
-			break;
-		case FFPL_TRIG_RECALC:
-			current_t = ffpl_get_recalculation_time(priv, eff, now);
-			eff->recalculate = true;
-			break;
-		default:
-			continue;
-		}
+	for (idx = 0; idx < FFPL_BENCH_VECTORS; idx++) {
+		const struct ffpl_bench_vector *v = &vecs[idx];
+		s16 level;
+		u16 dir;
+
+		fn(v->x, v->y, &level, &dir);
+		*dir_err = max_t(u32, *dir_err, abs((s16)(dir - v->direction)));
+		*lvl_err = max_t(u32, *lvl_err, abs(level - min(v->level, 0x7fff)));
+	}
 
-		eff->touch_at = current_t;
+	start = get_cycles();
+	for (i = 0; i < 64; i++) {
+		for (idx = 0; idx < FFPL_BENCH_VECTORS; idx++) {
+			s16 level;
+			u16 dir;
 
-		if (!events++) {
-			printk(KERN_NOTICE "KLGDFF: First event\n");
-			*t = current_t;
-		} else if (time_before(current_t, *t))
-			*t = current_t;
+			fn(vecs[idx].x, vecs[idx].y, &level, &dir);
+			ffpl_bench_sink = level + dir;
+		}
 	}
+	*cycles += get_cycles() - start;
+}
+
+/*
+ * Compare CORDIC vectoring with the previous polynomial atan and int_sqrt.
+ * Errors are the largest deviations in direction and level units,
+ * timing is the average number of cycles per call.
+ */
+ssize_t ffpl_bench_vectors(char *buf)
+{
+	/* Levels just below a power of two are scaled the most before the iterations */
+	static const s32 levels[] = { 0x400, 0x2000, 0x7fff, 0x40000, 1000, 1414, 5000, 23170, 46339 };
+	struct ffpl_bench_vector *vecs;
+	u32 dir_err_poly = 0, lvl_err_poly = 0, dir_err_cordic = 0, lvl_err_cordic = 0;
+	u64 cycles_poly = 0, cycles_cordic = 0;
+	const u32 calls = ARRAY_SIZE(levels) * 64 * FFPL_BENCH_VECTORS;
+	size_t idx;
 
+	vecs = kcalloc(FFPL_BENCH_VECTORS, sizeof(struct ffpl_bench_vector), GFP_KERNEL);
+	if (!vecs)
+		return -ENOMEM;
 
-	if (time_before(*t, now) && events) {
-		WARN(true, KERN_ERR "Scheduling for the past (now: %lu, sched %lu), fixing by sheduling for now\n", now, *t);
-		*t = now;
+	for (idx = 0; idx < ARRAY_SIZE(levels); idx++) {
+		ffpl_bench_make_vectors(vecs, levels[idx]);
+		ffpl_bench_vectors_one(ffpl_bench_x_y_to_lvl_dir_poly, vecs, &dir_err_poly, &lvl_err_poly, &cycles_poly);
+		ffpl_bench_vectors_one(ffpl_x_y_to_lvl_dir, vecs, &dir_err_cordic, &lvl_err_cordic, &cycles_cordic);
 	}
-	return events ? true : false;
+	kfree(vecs);
+
+	return scnprintf(buf, PAGE_SIZE, "impl max_dir_err max_lvl_err cycles_per_call\npoly %u %u %llu\ncordic %u %u %llu\n",
+			 dir_err_poly, lvl_err_poly, div_u64(cycles_poly, calls),
+			 dir_err_cordic, lvl_err_cordic, div_u64(cycles_cordic, calls));
 }
+EXPORT_SYMBOL_GPL(ffpl_bench_vectors);
+#endif
 
 static int ffpl_handle_state_change(struct klgd_plugin_private *priv, struct klgd_command_stream *s, struct ffpl_effect *eff,
-				    const unsigned long now)
+				    const ktime_t now)
 {
 	int ret;
 
+	trace_klgdff_state_change(eff);
+
 	/* Latest effect is of different type than currently active effect,
 	 * remove it from the device and upload the latest one */
 	if (eff->replace) {
 		switch (eff->change) {
 		case FFPL_TO_ERASE:
-			printk(KERN_NOTICE "KLGDFF: Rpl chg - TO_ERASE\n");
+			pr_debug("KLGDFF: Rpl chg - TO_ERASE\n");
 			switch (eff->state) {
 			case FFPL_STARTED:
 				ret = ffpl_stop_effect(priv, s, eff);
@@ -1518,7 +2946,7 @@ static int ffpl_handle_state_change(struct klgd_plugin_private *priv, struct klg
 			break;
 		case FFPL_TO_UPLOAD:
 		case FFPL_TO_STOP: /* There is no difference between stopping or uploading an effect when we are replacing it */
-			printk("KLGDFF: Rpl chg - TO_UPLOAD/TO_STOP\n");
+			pr_debug("KLGDFF: Rpl chg - TO_UPLOAD/TO_STOP\n");
 			switch (eff->state) {
 			case FFPL_STARTED:
 				/* Overwrite the currently active effect and set it to UPLOADED state */
@@ -1544,7 +2972,7 @@ static int ffpl_handle_state_change(struct klgd_plugin_private *priv, struct klg
 			break;
 		case FFPL_TO_START:
 		case FFPL_TO_UPDATE: /* There is no difference between staring or updating an effect when we are replacing it */
-			printk("KLGDFF: Rpl chg - TO_START/TO_UPDATE\n");
+			pr_debug("KLGDFF: Rpl chg - TO_START/TO_UPDATE\n");
 			switch (eff->state) {
 			case FFPL_STARTED:
 				if (priv->has_owr_to_srt) {
@@ -1590,7 +3018,7 @@ static int ffpl_handle_state_change(struct klgd_plugin_private *priv, struct klg
 
 	switch (eff->change) {
 	case FFPL_TO_UPLOAD:
-		printk(KERN_INFO "KLGDFF: Chg TO_UPLOAD\n");
+		pr_debug("KLGDFF: Chg TO_UPLOAD\n");
 		switch (eff->state) {
 		case FFPL_EMPTY:
 			ret = ffpl_upload_effect(priv, s, eff);
@@ -1604,7 +3032,7 @@ static int ffpl_handle_state_change(struct klgd_plugin_private *priv, struct klg
 		}
 		break;
 	case FFPL_TO_START:
-		printk(KERN_INFO "KLGDFF: Chg TO_START\n");
+		pr_debug("KLGDFF: Chg TO_START\n");
 		switch (eff->state) {
 		case FFPL_EMPTY:
 			if (priv->has_emp_to_srt) {
@@ -1623,7 +3051,7 @@ static int ffpl_handle_state_change(struct klgd_plugin_private *priv, struct klg
 		}
 		break;
 	case FFPL_TO_STOP:
-		printk(KERN_INFO "KLGDFF: Chg TO_STOP\n");
+		pr_debug("KLGDFF: Chg TO_STOP\n");
 		switch (eff->state) {
 		case FFPL_STARTED:
 			ret = ffpl_stop_effect(priv, s, eff);
@@ -1637,7 +3065,7 @@ static int ffpl_handle_state_change(struct klgd_plugin_private *priv, struct klg
 		}
 		break;
 	case FFPL_TO_ERASE:
-		printk(KERN_INFO "KLGDFF: Chg TO_ERASE\n");
+		pr_debug("KLGDFF: Chg TO_ERASE\n");
 		switch (eff->state) {
 		case FFPL_UPLOADED:
 			ret = ffpl_erase_effect(priv, s, eff);
@@ -1654,11 +3082,11 @@ static int ffpl_handle_state_change(struct klgd_plugin_private *priv, struct klg
 		}
 		break;
 	case FFPL_TO_UPDATE:
-		printk(KERN_INFO "KLGDFF: Chg TO_UPDATE\n");
+		pr_debug("KLGDFF: Chg TO_UPDATE\n");
 		ret = ffpl_update_effect(priv, s, eff);
 		break;
 	case FFPL_DONT_TOUCH:
-		printk(KERN_INFO "KLGDFF: Chg - NO CHANGE\n");
+		pr_debug("KLGDFF: Chg - NO CHANGE\n");
 		return 0;
 	default:
 		return -EINVAL;
@@ -1671,6 +3099,160 @@ static int ffpl_handle_state_change(struct klgd_plugin_private *priv, struct klg
 	return ret;
 }
 
+static int ffpl_latency_show(struct seq_file *m, void *unused)
+{
+	static const char * const names[FFPL_RQ_TYPE_COUNT] = { "upload", "playback", "erase", "autocenter", "gain" };
+	struct klgd_plugin_private *priv = m->private;
+	size_t type;
+	size_t idx;
+
+	seq_puts(m, "# Bucket N counts latencies shorter than 2^N us\n");
+	klgd_lock_plugins(priv->self->plugins_lock);
+	for (type = 0; type < FFPL_RQ_TYPE_COUNT; type++) {
+		seq_printf(m, "drain %-10s", names[type]);
+		for (idx = 0; idx < FFPL_LAT_BUCKETS; idx++)
+			seq_printf(m, " %u", priv->lat_drain[type][idx]);
+		seq_putc(m, '\n');
+	}
+	for (type = 0; type < FFPL_RQ_TYPE_COUNT; type++) {
+		seq_printf(m, "emit  %-10s", names[type]);
+		for (idx = 0; idx < FFPL_LAT_BUCKETS; idx++)
+			seq_printf(m, " %u", priv->lat_emit[type][idx]);
+		seq_putc(m, '\n');
+	}
+	klgd_unlock_plugins(priv->self->plugins_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ffpl_latency);
+
+static int ffpl_lateness_show(struct seq_file *m, void *unused)
+{
+	static const char * const names[FFPL_TRIG_COUNT] = {
+		"none", "now", "start", "preload", "restart", "stop", "recalc", "update"
+	};
+	struct klgd_plugin_private *priv = m->private;
+	size_t trig;
+	size_t idx;
+
+	seq_puts(m, "# trigger count min_ns mean_ns max_ns, then bucket N counts latenesses shorter than 2^N us\n");
+	klgd_lock_plugins(priv->self->plugins_lock);
+	for (trig = 0; trig < FFPL_TRIG_COUNT; trig++) {
+		const struct ffpl_lateness *l = &priv->lateness[trig];
+
+		seq_printf(m, "%-8s %lu %llu %llu %llu", names[trig], l->count, l->min,
+			   l->count ? div64_u64(l->total, l->count) : 0, l->max);
+		for (idx = 0; idx < FFPL_LAT_BUCKETS; idx++)
+			seq_printf(m, " %u", l->hist[idx]);
+		seq_putc(m, '\n');
+	}
+	klgd_unlock_plugins(priv->self->plugins_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ffpl_lateness);
+
+/* Writing anything to latency_reset clears the latency and lateness statistics */
+static int ffpl_latency_reset(void *data, u64 val)
+{
+	struct klgd_plugin_private *priv = data;
+
+	klgd_lock_plugins(priv->self->plugins_lock);
+	memset(priv->lat_drain, 0, sizeof(priv->lat_drain));
+	memset(priv->lat_emit, 0, sizeof(priv->lat_emit));
+	memset(priv->lateness, 0, sizeof(priv->lateness));
+	klgd_unlock_plugins(priv->self->plugins_lock);
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(ffpl_latency_reset_fops, NULL, ffpl_latency_reset, "%llu\n");
+
+/*
+ * Must be called with plugins_lock held.
+ * Counters of the request callbacks are protected by dev->event_lock instead.
+ */
+static void ffpl_fill_stats(const struct klgd_plugin_private *priv, struct ffpl_stats *stats)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->dev->event_lock, flags);
+	stats->uploads_dropped = priv->uploads_dropped;
+	stats->rq_overflows = priv->rq_overflows;
+	stats->rq_collapsed = priv->rq_collapsed;
+	spin_unlock_irqrestore(&priv->dev->event_lock, flags);
+
+	memcpy(stats->commands, priv->commands, sizeof(stats->commands));
+	stats->control_time = priv->control_time;
+	stats->recalculations = priv->recalculations;
+	stats->replacements = priv->replacements;
+	stats->uploads_skipped = priv->uploads_skipped;
+	stats->sched_overruns = priv->sched_overruns;
+	stats->updates_suppressed = priv->updates_suppressed;
+	stats->cmds_deferred = priv->cmds_deferred;
+	stats->cmds_merged = priv->cmds_merged;
+	stats->slot_hits = priv->slot_hits;
+	stats->slot_misses = priv->slot_misses;
+	stats->slot_evictions = priv->slot_evictions;
+	stats->preloads = priv->preloads;
+}
+
+static int ffpl_stats_show(struct seq_file *m, void *unused)
+{
+	static const char * const cmd_names[FFPL_CONTROL_COMMAND_COUNT] = {
+		"emp_to_upl", "upl_to_srt", "srt_to_upl", "upl_to_emp", "srt_to_udt", "emp_to_srt",
+		"srt_to_emp", "owr_to_upl", "owr_to_srt", "set_gain", "set_autocenter"
+	};
+	struct klgd_plugin_private *priv = m->private;
+	struct ffpl_stats stats;
+	size_t idx;
+
+	klgd_lock_plugins(priv->self->plugins_lock);
+	ffpl_fill_stats(priv, &stats);
+	for (idx = 0; idx < priv->effect_count; idx++) {
+		const struct ffpl_effect_stats *es = &priv->effects[idx].stats;
+
+		if (!es->uploads)
+			continue;
+		seq_printf(m, "effect %zu: uploads %lu commands %lu recalculations %lu replacements %lu\n",
+			   idx, es->uploads, es->commands, es->recalculations, es->replacements);
+	}
+	klgd_unlock_plugins(priv->self->plugins_lock);
+
+	for (idx = 0; idx < FFPL_CONTROL_COMMAND_COUNT; idx++)
+		seq_printf(m, "cmd_%s %lu\n", cmd_names[idx], stats.commands[idx]);
+	seq_printf(m, "control_time_ns %llu\n", stats.control_time);
+	seq_printf(m, "recalculations %lu\n", stats.recalculations);
+	seq_printf(m, "replacements %lu\n", stats.replacements);
+	seq_printf(m, "uploads_dropped %lu\n", stats.uploads_dropped);
+	seq_printf(m, "uploads_skipped %lu\n", stats.uploads_skipped);
+	seq_printf(m, "sched_overruns %lu\n", stats.sched_overruns);
+	seq_printf(m, "rq_overflows %lu\n", stats.rq_overflows);
+	seq_printf(m, "rq_collapsed %lu\n", stats.rq_collapsed);
+	seq_printf(m, "updates_suppressed %lu\n", stats.updates_suppressed);
+	seq_printf(m, "cmds_deferred %lu\n", stats.cmds_deferred);
+	seq_printf(m, "cmds_merged %lu\n", stats.cmds_merged);
+	seq_printf(m, "slot_hits %lu\n", stats.slot_hits);
+	seq_printf(m, "slot_misses %lu\n", stats.slot_misses);
+	seq_printf(m, "slot_evictions %lu\n", stats.slot_evictions);
+	seq_printf(m, "preloads %lu\n", stats.preloads);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ffpl_stats);
+
+/* Debugfs is optional, failures are not reported */
+static void ffpl_create_debugfs(struct klgd_plugin_private *priv)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "klgdff-%s", dev_name(&priv->dev->dev));
+	priv->debugfs = debugfs_create_dir(name, NULL);
+	debugfs_create_file("latency", 0444, priv->debugfs, priv, &ffpl_latency_fops);
+	debugfs_create_file("lateness", 0444, priv->debugfs, priv, &ffpl_lateness_fops);
+	debugfs_create_file("stats", 0444, priv->debugfs, priv, &ffpl_stats_fops);
+	debugfs_create_file_unsafe("latency_reset", 0200, priv->debugfs, priv, &ffpl_latency_reset_fops);
+}
+
 static int ffpl_init(struct klgd_plugin *self)
 {
 	struct klgd_plugin_private *priv = self->private;
@@ -1688,21 +3270,142 @@ static int ffpl_init(struct klgd_plugin *self)
 	dev->ff->set_gain = ffpl_set_gain_rq;
 	dev->ff->set_autocenter = ffpl_set_autocenter_rq;
 	dev->ff->destroy = ffpl_destroy_rq;
+	ffpl_create_debugfs(priv);
 	printk(KERN_NOTICE "KLGDFF: Init complete\n");
 
 	return 0;
 }
 
+/*
+ * Set how much the level of a memless effect may deviate from its exact
+ * waveform before the effect is recalculated. Slowly changing effects are
+ * recalculated less often and quickly changing ones more often than at the
+ * configured update rate. Zero, the default, recalculates all effects at the
+ * update rate.
+ */
+void ffpl_set_tolerance(struct klgd_plugin *plugin, const u16 tolerance)
+{
+	struct klgd_plugin_private *priv = plugin->private;
+
+	WRITE_ONCE(priv->tolerance, min_t(u16, tolerance, 0x7fff));
+}
+EXPORT_SYMBOL_GPL(ffpl_set_tolerance);
+
+/*
+ * Tell the plugin how many bits of the force level the device can resolve.
+ * Updates of combined effects that would not change the output of the device
+ * are not sent to it. Takes effect with the next recalculation.
+ */
+int ffpl_set_output_resolution(struct klgd_plugin *plugin, const unsigned int bits)
+{
+	struct klgd_plugin_private *priv = plugin->private;
+
+	if (!bits || bits > 16)
+		return -EINVAL;
+
+	/* Changes smaller than half of the least significant bit are lost in rounding */
+	WRITE_ONCE(priv->deadband, (0x10000U >> bits) / 2);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ffpl_set_output_resolution);
+
+/*
+ * Limit the number of commands sent to the device to "commands" per "window_ms"
+ * milliseconds. When the budget is exhausted, updates of started effects are
+ * postponed to the next window and merged with any newer updates. Commands that
+ * change the state of effects are never postponed. Zero commands removes the limit.
+ * Must be called before the plugin is registered.
+ */
+int ffpl_set_command_budget(struct klgd_plugin *plugin, const unsigned int commands, const unsigned int window_ms)
+{
+	struct klgd_plugin_private *priv = plugin->private;
+
+	if (commands && !window_ms)
+		return -EINVAL;
+
+	priv->budget = commands;
+	priv->budget_window = window_ms * NSEC_PER_MSEC;
+	priv->budget_used = 0;
+	priv->budget_reset_at = 0;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ffpl_set_command_budget);
+
+/*
+ * Tell the plugin that the device has fewer effect slots than the number of
+ * effects userspace may upload. Effects are then passed to the driver with
+ * the number of the device slot as their id. Idle effects are erased from
+ * the device when a slot is needed to start another effect and are uploaded
+ * again when they are started. Must be called before the plugin is registered.
+ */
+int ffpl_set_device_slots(struct klgd_plugin *plugin, const unsigned int slots)
+{
+	struct klgd_plugin_private *priv = plugin->private;
+	struct ffpl_effect **owners;
+
+	if (!slots)
+		return -EINVAL;
+
+	owners = kcalloc(slots, sizeof(struct ffpl_effect *), GFP_KERNEL);
+	if (!owners)
+		return -ENOMEM;
+
+	kfree(priv->hw_owners);
+	priv->hw_owners = owners;
+	priv->hw_slots = slots;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ffpl_set_device_slots);
+
+/*
+ * Read the device-wide performance counters.
+ * Must not be called before the plugin is registered with KLGD.
+ * May sleep, call from process context only.
+ */
+void ffpl_get_stats(struct klgd_plugin *plugin, struct ffpl_stats *stats)
+{
+	struct klgd_plugin_private *priv = plugin->private;
+
+	klgd_lock_plugins(plugin->plugins_lock);
+	ffpl_fill_stats(priv, stats);
+	klgd_unlock_plugins(plugin->plugins_lock);
+}
+EXPORT_SYMBOL_GPL(ffpl_get_stats);
+
+/*
+ * Read the performance counters of an effect slot.
+ * Counters are kept for the slot and are not reset when the effect is erased.
+ * May sleep, call from process context only.
+ */
+int ffpl_get_effect_stats(struct klgd_plugin *plugin, const int effect_id, struct ffpl_effect_stats *stats)
+{
+	struct klgd_plugin_private *priv = plugin->private;
+
+	if (effect_id < 0 || (size_t)effect_id >= priv->effect_count)
+		return -EINVAL;
+
+	klgd_lock_plugins(plugin->plugins_lock);
+	*stats = priv->effects[effect_id].stats;
+	klgd_unlock_plugins(plugin->plugins_lock);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ffpl_get_effect_stats);
+
 /* Initialize the plugin */
 int ffpl_init_plugin(struct klgd_plugin **plugin, struct input_dev *dev, const size_t effect_count,
-		     const unsigned long flags,
+		     const unsigned long flags, const unsigned int update_rate,
 		     int (*control)(struct input_dev *dev, struct klgd_command_stream *s, const enum ffpl_control_command cmd, const union ffpl_control_data data, void *user),
+		     int (*batch_control)(struct input_dev *dev, struct klgd_command_stream *s, const struct ffpl_transition *transitions, const size_t count, void *user),
 		     void *user)
 {
 	struct klgd_plugin *self;
 	struct klgd_plugin_private *priv;
+	unsigned int rq_ring_size;
 	int ret, idx;
 
+	if (update_rate > FFPL_UPDATE_RATE_MAX)
+		return -EINVAL;
+
 	self = kzalloc(sizeof(struct klgd_plugin), GFP_KERNEL);
 	if (!self)
 		return -ENOMEM;
@@ -1723,8 +3426,40 @@ int ffpl_init_plugin(struct klgd_plugin **plugin, struct input_dev *dev, const s
 		priv->effects[idx].uploaded_to_device = false;
 		priv->effects[idx].state = FFPL_EMPTY;
 		priv->effects[idx].change = FFPL_DONT_TOUCH;
+		priv->effects[idx].hw_slot = -1;
+		INIT_LIST_HEAD(&priv->effects[idx].hw_lru);
+	}
+	priv->combined_effect_cf.hw_slot = -1;
+	INIT_LIST_HEAD(&priv->combined_effect_cf.hw_lru);
+	priv->combined_effect_rumble.hw_slot = -1;
+	INIT_LIST_HEAD(&priv->combined_effect_rumble.hw_lru);
+	INIT_LIST_HEAD(&priv->hw_lru);
+
+	/* The index is made of five bitmaps sharing one allocation */
+	priv->started_cf = kcalloc(5 * BITS_TO_LONGS(effect_count), sizeof(unsigned long), GFP_KERNEL);
+	if (!priv->started_cf) {
+		ret = -ENOMEM;
+		goto err_out_effects;
+	}
+	priv->started_rumble = priv->started_cf + BITS_TO_LONGS(effect_count);
+	priv->pending = priv->started_rumble + BITS_TO_LONGS(effect_count);
+	priv->dirty_cf = priv->pending + BITS_TO_LONGS(effect_count);
+	priv->dirty_rumble = priv->dirty_cf + BITS_TO_LONGS(effect_count);
+
+	priv->dl_heap = kcalloc(effect_count, sizeof(unsigned int), GFP_KERNEL);
+	if (!priv->dl_heap) {
+		ret = -ENOMEM;
+		goto err_out_index;
 	}
 
+	rq_ring_size = roundup_pow_of_two(max_t(size_t, FFPL_RQ_RING_MIN, effect_count * FFPL_RQ_RING_PER_EFFECT));
+	priv->rq_ring = kcalloc(rq_ring_size, sizeof(struct ffpl_request), GFP_KERNEL);
+	if (!priv->rq_ring) {
+		ret = -ENOMEM;
+		goto err_out_heap;
+	}
+	priv->rq_ring_mask = rq_ring_size - 1;
+
 	self->deinit = ffpl_deinit;
 	self->get_commands = ffpl_get_commands;
 	self->get_update_time = ffpl_get_update_time;
@@ -1732,15 +3467,17 @@ int ffpl_init_plugin(struct klgd_plugin **plugin, struct input_dev *dev, const s
 	priv->effect_count = effect_count;
 	priv->dev = dev;
 	priv->control = control;
+	priv->batch_control = batch_control;
 	priv->user = user;
 	priv->gain = 0xFFFF;
+	priv->update_period = NSEC_PER_SEC / (update_rate ? update_rate : FFPL_UPDATE_RATE_DEFAULT);
+	priv->tolerance = FFPL_TOLERANCE_DEFAULT;
 	priv->rqwq = create_singlethread_workqueue("ffpl_request_work");
 	if (!priv->rqwq) {
 		ret = -ENOMEM;
-		goto err_out2;
+		goto err_out_ring;
 	}
 	INIT_WORK(&priv->rqwq_work, ffpl_request_work);
-	INIT_LIST_HEAD(&priv->rq_list);
 
 	self->private = priv;
 	priv->self = self;
@@ -1798,6 +3535,10 @@ int ffpl_init_plugin(struct klgd_plugin **plugin, struct input_dev *dev, const s
 		priv->memless_rumble = true;
 	if (FFPL_TIMING_CONDITION & flags)
 		priv->timing_condition = true;
+	if ((FFPL_PRELOAD_DELAYED & flags) && priv->upload_when_started) {
+		priv->preload_delayed = true;
+		printk(KERN_NOTICE "KLGDFF: Using PRELOAD DELAYED\n");
+	}
 	/* Set up emulation memless mode flags */
 	/** Emulate rumble through constant force */
 	if (test_bit(FF_CONSTANT, dev->ffbit) && !test_bit(FF_RUMBLE, dev->ffbit)) {
@@ -1824,10 +3565,34 @@ int ffpl_init_plugin(struct klgd_plugin **plugin, struct input_dev *dev, const s
 	}
 	input_set_capability(dev, EV_FF, FF_GAIN);
 
+	/* Worst case is every slot being replaced and both combined effects restarted along with gain and autocenter */
+	if (priv->has_owr_to_srt)
+		priv->stream_capacity = effect_count;
+	else if (priv->has_emp_to_srt)
+		priv->stream_capacity = effect_count * 3;
+	else
+		priv->stream_capacity = effect_count * 4;
+	priv->stream_capacity += 2 * 4 + 2;
+	if (batch_control) {
+		priv->batch = kcalloc(priv->stream_capacity, sizeof(struct ffpl_transition), GFP_KERNEL);
+		if (!priv->batch) {
+			ret = -ENOMEM;
+			goto err_out3;
+		}
+	}
+
 	return 0;
 
 err_out3:
 	destroy_workqueue(priv->rqwq);
+err_out_ring:
+	kfree(priv->rq_ring);
+err_out_heap:
+	kfree(priv->dl_heap);
+err_out_index:
+	kfree(priv->started_cf);
+err_out_effects:
+	kfree(priv->effects);
 err_out2:
 	kfree(priv);
 err_out1:
@@ -1836,20 +3601,41 @@ err_out1:
 }
 EXPORT_SYMBOL_GPL(ffpl_init_plugin);
 
+/*
+ * Free a plugin that has not been registered with KLGD, e.g. when setting
+ * it up after ffpl_init_plugin() fails. Registered plugins are torn down
+ * by KLGD and the input device instead.
+ */
+void ffpl_free_plugin(struct klgd_plugin *plugin)
+{
+	struct klgd_plugin_private *priv = plugin->private;
+
+	destroy_workqueue(priv->rqwq);
+	kfree(priv->hw_owners);
+	kfree(priv->batch);
+	kfree(priv->rq_ring);
+	kfree(priv->dl_heap);
+	kfree(priv->started_cf);
+	kfree(priv->effects);
+	kfree(priv);
+	kfree(plugin);
+}
+EXPORT_SYMBOL_GPL(ffpl_free_plugin);
+
 static bool ffpl_needs_replacing(const struct ff_effect *ac_eff, const struct ff_effect *la_eff)
 {
 	if (ac_eff->type != la_eff->type) {
-		printk(KERN_NOTICE "KLGDFF: Effects are of different type - replacing (%d x %d)\n", ac_eff->type, la_eff->type);
+		pr_debug("KLGDFF: Effects are of different type - replacing (%d x %d)\n", ac_eff->type, la_eff->type);
 		return true;
 	}
 
 	if (ac_eff->type == FF_PERIODIC) {
 		if (ac_eff->u.periodic.waveform != la_eff->u.periodic.waveform) {
-			printk(KERN_NOTICE "KLGDFF: Effects have different waveforms - replacing\n");
+			pr_debug("KLGDFF: Effects have different waveforms - replacing\n");
 			return true;
 		}
 	}
 
-	printk(KERN_NOTICE "KLGDFF: Effect does not have to be replaced, updating\n");
+	pr_debug("KLGDFF: Effect does not have to be replaced, updating\n");
 	return false;
 }
@@ -1,5 +1,10 @@
 #include <linux/input.h>
+/* The userspace harness provides its own KLGD, see userspace/Makefile */
+#ifdef FFPL_KLGD_HEADER
+#include FFPL_KLGD_HEADER
+#else
 #include "../../KLGD/klgd.h"
+#endif
 
 /*
  * Preserving full direction for FF_RUMBLE effects is not necessary
@@ -48,9 +53,18 @@
 					    Device must support FF_RUMBLE for this to work. */
 
 #define FFPL_TIMING_CONDITION BIT(10)	 /* Let the plugin take care of starting and stopping of condition effects */
+#define FFPL_PRELOAD_DELAYED BIT(11)	 /* Upload delayed effects to the device ahead of their start so that only UPL_TO_SRT is sent at the start.
+					    Applies to UPLOAD_WHEN_STARTED devices, device must accept EMP_TO_UPL for this to work. */
 
 #define FFPL_HAS_NATIVE_GAIN BIT(15)  /* Device can adjust the gain by itself */
 
+/* Rate of recalculation of memless effects in Hz, passing 0 to ffpl_init_plugin() selects the default */
+#define FFPL_UPDATE_RATE_DEFAULT 50
+#define FFPL_UPDATE_RATE_MAX 1000
+/* Default allowed deviation of memless effects between recalculations, see ffpl_set_tolerance().
+   Zero recalculates memless effects at the update rate, drivers have to opt in to tolerance-based timing. */
+#define FFPL_TOLERANCE_DEFAULT 0
+
 
 enum ffpl_control_command {
 	/* Force feedback state transitions */
@@ -68,11 +82,24 @@ enum ffpl_control_command {
 	FFPL_SET_GAIN,	 /* Set gain */
 	FFPL_SET_AUTOCENTER /*Set autocenter */
 };
+#define FFPL_CONTROL_COMMAND_COUNT (FFPL_SET_AUTOCENTER + 1)
+
+/* Parameters of an effect changed by FFPL_SRT_TO_UDT */
+#define FFPL_CHANGED_LEVEL BIT(0)	/* Level, magnitude or rumble magnitudes */
+#define FFPL_CHANGED_DIRECTION BIT(1)
+#define FFPL_CHANGED_ENVELOPE BIT(2)
+#define FFPL_CHANGED_PERIOD BIT(3)
+#define FFPL_CHANGED_PHASE BIT(4)
+#define FFPL_CHANGED_OFFSET BIT(5)
+#define FFPL_CHANGED_CONDITION BIT(6)	/* Any of the condition coefficients */
+#define FFPL_CHANGED_REPLAY BIT(7)	/* Replay length or delay */
+#define FFPL_CHANGED_TRIGGER BIT(8)
 
 struct ffpl_effects {
 	const struct ff_effect *cur;  /* Pointer to the effect that is being uploaded/started/stopped/erased */
-	const struct ff_effect *old;  /* Pointer to the currently active effect. Valid only with OWR_* commands, otherwise NULL */
+	const struct ff_effect *old;  /* Pointer to the currently active effect. Valid only with OWR_* and SRT_TO_UDT commands, otherwise NULL */
 	int repeat; /* How many times to repeat playback - valid only with *_SRT commands */
+	u16 changed; /* FFPL_CHANGED_* mask of parameters that differ between old and cur - valid only with SRT_TO_UDT */
 };
 
 union ffpl_control_data {
@@ -81,8 +108,60 @@ union ffpl_control_data {
 	u16 gain;
 };
 
+/* State transition passed to the batch control callback */
+struct ffpl_transition {
+	enum ffpl_control_command cmd;
+	union ffpl_control_data data; /* Effect pointers point to the copies below */
+	struct ff_effect cur;
+	struct ff_effect old;
+};
+
+/* Device-wide performance counters, see ffpl_get_stats() */
+struct ffpl_stats {
+	unsigned long commands[FFPL_CONTROL_COMMAND_COUNT]; /* Commands passed to the driver, indexed by command */
+	u64 control_time;		  /* Time spent in the control callbacks - in nanoseconds */
+	unsigned long recalculations;	  /* Recalculations of memless effects */
+	unsigned long replacements;	  /* Effects that had to be replaced instead of updated */
+	unsigned long uploads_dropped;	  /* Uploads identical to the previous upload of the effect */
+	unsigned long uploads_skipped;	  /* Uploads postponed because no device slot was free */
+	unsigned long sched_overruns;	  /* Trip points processed more than one update period or jiffy late */
+	unsigned long rq_overflows;	  /* Requests that did not fit into the request ring */
+	unsigned long rq_collapsed;	  /* Requests superseded by newer requests before they were handled */
+	unsigned long updates_suppressed; /* Updates of combined effects not sent because they were within the deadband */
+	unsigned long cmds_deferred;	  /* Updates postponed to the next budget window */
+	unsigned long cmds_merged;	  /* Updates superseded by newer updates before they were sent */
+	unsigned long slot_hits;	  /* Started effects that were already held by the device */
+	unsigned long slot_misses;	  /* Started effects that had to be uploaded to the device first */
+	unsigned long slot_evictions;	  /* Idle effects erased from the device to make room for another effect */
+	unsigned long preloads;		  /* Delayed effects uploaded to device ahead of their start */
+};
+
+/* Per-effect performance counters, see ffpl_get_effect_stats() */
+struct ffpl_effect_stats {
+	unsigned long uploads;		/* Uploads handled by the plugin */
+	unsigned long commands;		/* Commands passed to the driver */
+	unsigned long recalculations;	/* Recalculations of the effect as a memless effect */
+	unsigned long replacements;	/* Times the effect had to be replaced instead of updated */
+};
+
 void ffpl_lvl_dir_to_x_y(const s32 level, const u16 direction, s32 *x, s32 *y);
 int ffpl_init_plugin(struct klgd_plugin **plugin, struct input_dev *dev, const size_t effect_count,
-		     const unsigned long flags,
+		     const unsigned long flags, const unsigned int update_rate,
 		     int (*control)(struct input_dev *dev, struct klgd_command_stream *s, const enum ffpl_control_command cmd, const union ffpl_control_data data, void *user),
+		     int (*batch_control)(struct input_dev *dev, struct klgd_command_stream *s, const struct ffpl_transition *transitions, const size_t count, void *user),
 		     void *user);
+void ffpl_free_plugin(struct klgd_plugin *plugin);
+void ffpl_set_tolerance(struct klgd_plugin *plugin, const u16 tolerance);
+int ffpl_set_output_resolution(struct klgd_plugin *plugin, const unsigned int bits);
+int ffpl_set_command_budget(struct klgd_plugin *plugin, const unsigned int commands, const unsigned int window_ms);
+int ffpl_set_device_slots(struct klgd_plugin *plugin, const unsigned int slots);
+/* May sleep */
+void ffpl_get_stats(struct klgd_plugin *plugin, struct ffpl_stats *stats);
+/* May sleep */
+int ffpl_get_effect_stats(struct klgd_plugin *plugin, const int effect_id, struct ffpl_effect_stats *stats);
+
+#ifdef FFPL_BENCHMARK
+ssize_t ffpl_bench_deadlines(char *buf);
+ssize_t ffpl_bench_directions(char *buf);
+ssize_t ffpl_bench_vectors(char *buf);
+#endif
@@ -1,4 +1,5 @@
 #include "klgd_ff_plugin.h"
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/workqueue.h>
 
@@ -24,11 +25,13 @@ enum ffpl_trigger {
 	FFPL_TRIG_NONE,	    /* No timing event scheduled for and effect */
 	FFPL_TRIG_NOW,	    /* State change has been set elsewhere and is to be processed immediately */
 	FFPL_TRIG_START,    /* Effect is to be started */
+	FFPL_TRIG_PRELOAD,  /* Effect is to be uploaded to device ahead of its start */
 	FFPL_TRIG_RESTART,  /* Effect is to be restarted */
 	FFPL_TRIG_STOP,	    /* Effect is to be stopped */
 	FFPL_TRIG_RECALC,   /* Effect needs to be recalculated */
 	FFPL_TRIG_UPDATE    /* Effect needs to be updated */
 };
+#define FFPL_TRIG_COUNT (FFPL_TRIG_UPDATE + 1)
 
 /* Type of the scheduled request */
 enum ffpl_request_type {
@@ -38,23 +41,85 @@ enum ffpl_request_type {
 	FFPL_RQ_AUTOCENTER,
 	FFPL_RQ_GAIN
 };
+#define FFPL_RQ_TYPE_COUNT (FFPL_RQ_GAIN + 1)
+
+/* Minimum number of entries in the request ring */
+#define FFPL_RQ_RING_MIN 64
+/* Number of ring entries reserved for each effect slot */
+#define FFPL_RQ_RING_PER_EFFECT 4
+/* Number of buckets of the latency histograms. Bucket N counts latencies shorter than 2^N microseconds,
+ * the last bucket counts everything longer */
+#define FFPL_LAT_BUCKETS 24
+
+/* Properties of an effect that depend only on its type and device capabilities.
+ * Computed once when the effect is uploaded. */
+struct ffpl_effect_class {
+	u8 handlers;			/* Combining handlers that process the effect */
+	u8 combiner;			/* Combined effect that has to be updated when the effect changes */
+	bool ticks;			/* Effect has to be recalculated periodically */
+	bool has_envelope;		/* Effect has an envelope with nonzero attack or fade */
+	bool timed;			/* Effect is started and stopped by the plugin */
+};
+
+/* Part of an envelope where the level changes linearly */
+struct ffpl_env_segment {
+	ktime_t begin;			/* Beginning of the segment */
+	u64 length;			/* Length of the segment - in nanoseconds, zero if the segment does not end */
+	s32 level;			/* Level at the beginning of the segment */
+	s64 slope;			/* Change of level per nanosecond in Q40 */
+};
+
+/* How late the trip points of one kind were processed */
+struct ffpl_lateness {
+	unsigned long count;
+	u64 min;			/* In nanoseconds */
+	u64 max;
+	u64 total;
+	u32 hist[FFPL_LAT_BUCKETS];	/* Same buckets as the latency histograms */
+};
 
 struct ffpl_effect {
 	struct ff_effect active;	/* Last effect submitted to device */
 	struct ff_effect latest;	/* Last effect submitted to us by userspace */
+	struct ff_effect queued;	/* Last effect uploaded by userspace, waiting in the request ring */
+	bool queued_valid;		/* Queued effect has not been erased since it was uploaded */
+	struct ffpl_effect_class cls_active; /* Classification of the active effect */
+	struct ffpl_effect_class cls_latest; /* Classification of the latest effect */
+	struct ffpl_request *rq_upload;	/* Pending upload request in the batch being coalesced */
+	struct ffpl_request *rq_playback; /* Pending playback request in the batch being coalesced */
+	ktime_t rq_at;			/* Submission time of the oldest request that has not been processed by ffpl_get_commands() yet, zero if none */
+	enum ffpl_request_type rq_type;	/* Type of that request */
 	enum ffpl_st_change change;	/* State to which the effect shall be put */
 	enum ffpl_state state;		/* State of the active effect */
 	bool replace;			/* Active effect has to be replaced => active effect shall be erased and latest uploaded */
 	bool uploaded_to_device;	/* Effect was physically uploaded to device */
+	u16 changed;			/* FFPL_CHANGED_* mask of parameters that differ between the active and the latest effect */
+	int hw_slot;			/* Device slot holding the effect, -1 if none. Used only if the device slots are limited */
+	struct list_head hw_lru;	/* Entry in the LRU of idle effects held by the device */
 
 	enum ffpl_trigger trigger;	/* What to do with the effect at its nearest timing trip point */
 	int repeat;			/* How many times to repeat an effect - set in playback_rq */
-	unsigned long start_at;		/* Time when to start the effect - in jiffies */
-	unsigned long stop_at;		/* Time when to stop the effect - in jiffies */
-	unsigned long updated_at;	/* Time when the effect was recalculated last time - in jiffies */
-	unsigned long touch_at;		/* Time of the next modification of the effect - in jiffies */
-	u16 playback_time;		/* Used internally by effect processor to calculate periods */
+	ktime_t start_at;		/* Time when to start the effect */
+	ktime_t stop_at;		/* Time when to stop the effect */
+	ktime_t updated_at;		/* Time when the effect was recalculated last time */
+	ktime_t touch_at;		/* Time of the next modification of the effect */
+	struct ffpl_effect_stats stats;
+	unsigned int dl_pos;		/* Position in the deadline heap, valid only if the effect is pending */
+	/* Attack, sustain and fade of the envelope compiled into linear segments */
+	struct ffpl_env_segment env_segs[3];
+	unsigned int env_seg_count;
+	/* Phase of periodic effects, 2^64 is one period */
+	u64 phase;			/* Phase accumulated since the effect was started */
+	u64 phase_step;			/* Phase increment per nanosecond */
+	u64 phase_offset;		/* Phase of the waveform set by userspace */
 	bool recalculate;		/* Effect shall be recalculated in the respective processing loop */
+	/* Last contribution of the effect to the combined effects */
+	s32 cf_x;
+	s32 cf_y;
+	s32 strong_x;
+	s32 strong_y;
+	s32 weak_x;
+	s32 weak_y;
 };
 
 struct ffpl_request_playback {
@@ -62,8 +127,8 @@ struct ffpl_request_playback {
 	int value;
 };
 
+/* Uploaded effects are passed through ffpl_effect.queued to keep the ring entries small */
 union ffpl_request_data {
-	struct ff_effect upload_effect;
 	struct ffpl_request_playback pb;
 	int effect_id;
 	u16 autocenter;
@@ -72,17 +137,30 @@ union ffpl_request_data {
 
 struct ffpl_request {
 	enum ffpl_request_type type;
+	bool collapsed;			/* Request was superseded by a newer one in the same batch */
+	ktime_t submitted_at;
 	union ffpl_request_data data;
 };
 
-struct ffpl_request_task {
-	struct ffpl_request rq;
-	struct list_head rq_list;
-};
-
 struct klgd_plugin_private {
 	struct klgd_plugin *self;
 	struct ffpl_effect *effects;
+	/* Index of effects that have to be visited by the processing loops */
+	unsigned long *started_cf;	/* Started effects combined into the constant force effect */
+	unsigned long *started_rumble;	/* Started effects combined into the rumble effect */
+	unsigned long *pending;		/* Effects with a timing trip point scheduled */
+	unsigned long *dirty_cf;	/* Started effects whose contribution to the combined constant force has to be reevaluated */
+	unsigned long *dirty_rumble;	/* Started effects whose contribution to the combined rumble has to be reevaluated */
+	/* Sums of the last contributions of all started combinable effects */
+	s32 cf_x;
+	s32 cf_y;
+	s32 strong_x;
+	s32 strong_y;
+	s32 weak_x;
+	s32 weak_y;
+	/* Binary min-heap of pending effects ordered by touch_at */
+	unsigned int *dl_heap;
+	unsigned int dl_count;
 	struct ffpl_effect combined_effect_cf;
 	struct ffpl_effect combined_effect_rumble;
 	unsigned long supported_effects;
@@ -91,12 +169,43 @@ struct klgd_plugin_private {
 
 	struct workqueue_struct *rqwq;
 	struct work_struct rqwq_work;
-	struct list_head rq_list;
+	/* Ring of pending requests. Submitters and the request worker are serialized by dev->event_lock */
+	struct ffpl_request *rq_ring;
+	unsigned int rq_ring_mask;
+	unsigned int rq_head;		/* Index of the next free entry */
+	unsigned int rq_tail;		/* Index of the oldest pending entry */
+	/* Gain and autocenter requests that did not fit into the ring */
+	u16 rq_latched_gain;
+	u16 rq_latched_autocenter;
+	bool rq_gain_latched;
+	bool rq_autocenter_latched;
+	/* Submission times of gain and autocenter requests waiting for ffpl_get_commands(), zero if none */
+	ktime_t rq_gain_at;
+	ktime_t rq_autocenter_at;
+	size_t stream_capacity;		/* Most commands one update can generate */
 
 	int (*control)(struct input_dev *dev, struct klgd_command_stream *s, const enum ffpl_control_command cmd, const union ffpl_control_data data, void *user);
+	int (*batch_control)(struct input_dev *dev, struct klgd_command_stream *s, const struct ffpl_transition *transitions, const size_t count, void *user);
+	struct ffpl_transition *batch;	/* Transitions collected for batch_control */
+	size_t batch_count;
 	void *user;
 	u16 gain;
 	u16 autocenter;
+	u32 update_period;		/* Interval between recalculations of memless effects - in nanoseconds */
+	u16 tolerance;			/* Allowed deviation of memless effects between recalculations, zero to use update_period */
+	u16 deadband;			/* Largest change of a combined effect that is not sent to device */
+	/* Device slots, used only if the device has fewer slots than userspace */
+	unsigned int hw_slots;
+	struct ffpl_effect **hw_owners;	/* Effect held by each device slot */
+	struct list_head hw_lru;	/* Uploaded but idle effects held by the device, least recently used first */
+	bool slot_exhausted;		/* ffpl_claim_slot() found every slot taken by a playing effect, cleared before each state change */
+	ktime_t slot_retry_at;		/* When to retry combined effects that did not get a slot, zero if none */
+	u64 upload_latency;		/* Average time the driver takes to process a command that uploads an effect - in nanoseconds */
+	/* Command budget */
+	unsigned int budget;		/* Commands that can be sent to device per budget window, zero for unlimited */
+	u32 budget_window;		/* Length of the budget window - in nanoseconds */
+	unsigned int budget_used;	/* Commands sent in the current budget window */
+	ktime_t budget_reset_at;	/* End of the current budget window */
 	/* Optional device capabilities */
 	bool has_emp_to_srt;
 	bool has_srt_to_emp;
@@ -113,9 +222,32 @@ struct klgd_plugin_private {
 	bool memless_rumble;
 	bool memless_rumble_emul; /* Emulate FF_RUMBLE through constant force */
 	bool timing_condition;
-	u32 padding_caps:17;
+	bool preload_delayed;
+	u32 padding_caps:16;
 	/* Device-wide state changes */
 	bool change_gain;
 	bool change_autocenter;
 	u32 padding_dw:30;
+	/* Statistics */
+	unsigned long commands[FFPL_CONTROL_COMMAND_COUNT]; /* Commands passed to the driver */
+	u64 control_time;		/* Time spent in the control callbacks - in nanoseconds */
+	unsigned long recalculations;	/* Recalculations of memless effects */
+	unsigned long replacements;	/* Effects that had to be replaced instead of updated */
+	unsigned long uploads_skipped;	/* Uploads postponed because no device slot was free */
+	unsigned long sched_overruns;	/* Trip points processed more than one update period or jiffy late */
+	unsigned long rq_overflows;	/* Requests that did not fit into the request ring */
+	unsigned long rq_collapsed;	/* Requests superseded by newer requests before they were handled */
+	unsigned long uploads_dropped;	/* Uploads identical to the previous upload of the effect that were not queued */
+	unsigned long updates_suppressed; /* Updates of combined effects not sent because they were within the deadband */
+	unsigned long cmds_deferred;	/* Updates postponed to the next budget window */
+	unsigned long cmds_merged;	/* Updates superseded by newer updates before they were sent */
+	unsigned long slot_hits;	/* Started effects that were already held by the device */
+	unsigned long slot_misses;	/* Started effects that had to be uploaded to the device first */
+	unsigned long slot_evictions;	/* Idle effects erased from the device to make room for another effect */
+	unsigned long preloads;		/* Delayed effects uploaded to device ahead of their start */
+	/* Latency histograms of userspace requests, exposed through debugfs */
+	u32 lat_drain[FFPL_RQ_TYPE_COUNT][FFPL_LAT_BUCKETS];	/* From submission to the request worker */
+	u32 lat_emit[FFPL_RQ_TYPE_COUNT][FFPL_LAT_BUCKETS];	/* From submission to ffpl_get_commands() */
+	struct ffpl_lateness lateness[FFPL_TRIG_COUNT];	/* Processing of trip points after their touch_at, by trigger */
+	struct dentry *debugfs;
 };
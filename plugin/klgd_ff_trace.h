@@ -0,0 +1,193 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM klgdff
+
+#if !defined(_KLGD_FF_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KLGD_FF_TRACE_H
+
+/* klgd_ff_plugin_p.h has to be included beforehand */
+#include <linux/tracepoint.h>
+
+#define FFPL_TRACE_CMDS						\
+	{ FFPL_EMP_TO_UPL, "EMP_TO_UPL" },			\
+	{ FFPL_UPL_TO_SRT, "UPL_TO_SRT" },			\
+	{ FFPL_SRT_TO_UPL, "SRT_TO_UPL" },			\
+	{ FFPL_UPL_TO_EMP, "UPL_TO_EMP" },			\
+	{ FFPL_SRT_TO_UDT, "SRT_TO_UDT" },			\
+	{ FFPL_EMP_TO_SRT, "EMP_TO_SRT" },			\
+	{ FFPL_SRT_TO_EMP, "SRT_TO_EMP" },			\
+	{ FFPL_OWR_TO_UPL, "OWR_TO_UPL" },			\
+	{ FFPL_OWR_TO_SRT, "OWR_TO_SRT" },			\
+	{ FFPL_SET_GAIN, "SET_GAIN" },				\
+	{ FFPL_SET_AUTOCENTER, "SET_AUTOCENTER" }
+
+/* Userspace request put into the request ring */
+TRACE_EVENT(klgdff_rq_submit,
+	TP_PROTO(const struct ffpl_request *rq, const unsigned int depth),
+	TP_ARGS(rq, depth),
+	TP_STRUCT__entry(
+		__field(int, type)
+		__field(int, effect_id)
+		__field(int, value)
+		__field(unsigned int, depth)
+	),
+	TP_fast_assign(
+		__entry->type = rq->type;
+		__entry->depth = depth;
+		switch (rq->type) {
+		case FFPL_RQ_PLAYBACK:
+			__entry->effect_id = rq->data.pb.effect_id;
+			__entry->value = rq->data.pb.value;
+			break;
+		case FFPL_RQ_UPLOAD:
+		case FFPL_RQ_ERASE:
+			__entry->effect_id = rq->data.effect_id;
+			__entry->value = 0;
+			break;
+		case FFPL_RQ_AUTOCENTER:
+			__entry->effect_id = -1;
+			__entry->value = rq->data.autocenter;
+			break;
+		default:
+			__entry->effect_id = -1;
+			__entry->value = rq->data.gain;
+			break;
+		}
+	),
+	TP_printk("type=%s effect=%d value=%d depth=%u",
+		  __print_symbolic(__entry->type,
+				   { FFPL_RQ_UPLOAD, "UPLOAD" },
+				   { FFPL_RQ_PLAYBACK, "PLAYBACK" },
+				   { FFPL_RQ_ERASE, "ERASE" },
+				   { FFPL_RQ_AUTOCENTER, "AUTOCENTER" },
+				   { FFPL_RQ_GAIN, "GAIN" }),
+		  __entry->effect_id, __entry->value, __entry->depth)
+);
+
+/* Request worker is about to handle the requests in the ring */
+TRACE_EVENT(klgdff_rq_drain,
+	TP_PROTO(const unsigned int count, const bool latched),
+	TP_ARGS(count, latched),
+	TP_STRUCT__entry(
+		__field(unsigned int, count)
+		__field(bool, latched)
+	),
+	TP_fast_assign(
+		__entry->count = count;
+		__entry->latched = latched;
+	),
+	TP_printk("count=%u latched=%d", __entry->count, __entry->latched)
+);
+
+/* Effect is processed by the state machine */
+TRACE_EVENT(klgdff_state_change,
+	TP_PROTO(const struct ffpl_effect *eff),
+	TP_ARGS(eff),
+	TP_STRUCT__entry(
+		__field(int, effect_id)
+		__field(int, change)
+		__field(int, state)
+		__field(int, trigger)
+		__field(bool, replace)
+	),
+	TP_fast_assign(
+		__entry->effect_id = eff->latest.id;
+		__entry->change = eff->change;
+		__entry->state = eff->state;
+		__entry->trigger = eff->trigger;
+		__entry->replace = eff->replace;
+	),
+	TP_printk("effect=%d change=%s state=%s trigger=%d replace=%d",
+		  __entry->effect_id,
+		  __print_symbolic(__entry->change,
+				   { FFPL_DONT_TOUCH, "DONT_TOUCH" },
+				   { FFPL_TO_UPLOAD, "TO_UPLOAD" },
+				   { FFPL_TO_START, "TO_START" },
+				   { FFPL_TO_STOP, "TO_STOP" },
+				   { FFPL_TO_ERASE, "TO_ERASE" },
+				   { FFPL_TO_UPDATE, "TO_UPDATE" }),
+		  __print_symbolic(__entry->state,
+				   { FFPL_EMPTY, "EMPTY" },
+				   { FFPL_UPLOADED, "UPLOADED" },
+				   { FFPL_STARTED, "STARTED" }),
+		  __entry->trigger, __entry->replace)
+);
+
+/* Command passed to the driver */
+TRACE_EVENT(klgdff_control,
+	TP_PROTO(const enum ffpl_control_command cmd, const union ffpl_control_data *data, const int ret),
+	TP_ARGS(cmd, data, ret),
+	TP_STRUCT__entry(
+		__field(int, cmd)
+		__field(int, effect_id)
+		__field(int, value)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+		switch (cmd) {
+		case FFPL_SET_GAIN:
+			__entry->effect_id = -1;
+			__entry->value = data->gain;
+			break;
+		case FFPL_SET_AUTOCENTER:
+			__entry->effect_id = -1;
+			__entry->value = data->autocenter;
+			break;
+		default:
+			__entry->effect_id = data->effects.cur->id;
+			__entry->value = data->effects.changed;
+			break;
+		}
+	),
+	TP_printk("cmd=%s effect=%d value=0x%x ret=%d",
+		  __print_symbolic(__entry->cmd, FFPL_TRACE_CMDS),
+		  __entry->effect_id, __entry->value, __entry->ret)
+);
+
+/* Overall force of the combined constant force effect */
+TRACE_EVENT(klgdff_combined_cf,
+	TP_PROTO(const s32 x, const s32 y, const s16 level, const u16 direction),
+	TP_ARGS(x, y, level, direction),
+	TP_STRUCT__entry(
+		__field(s32, x)
+		__field(s32, y)
+		__field(s16, level)
+		__field(u16, direction)
+	),
+	TP_fast_assign(
+		__entry->x = x;
+		__entry->y = y;
+		__entry->level = level;
+		__entry->direction = direction;
+	),
+	TP_printk("x=%d y=%d level=%d direction=0x%04x",
+		  __entry->x, __entry->y, __entry->level, __entry->direction)
+);
+
+/* Overall force of the combined rumble effect */
+TRACE_EVENT(klgdff_combined_rumble,
+	TP_PROTO(const u16 strong, const u16 weak, const u16 direction),
+	TP_ARGS(strong, weak, direction),
+	TP_STRUCT__entry(
+		__field(u16, strong)
+		__field(u16, weak)
+		__field(u16, direction)
+	),
+	TP_fast_assign(
+		__entry->strong = strong;
+		__entry->weak = weak;
+		__entry->direction = direction;
+	),
+	TP_printk("strong=%u weak=%u direction=0x%x",
+		  __entry->strong, __entry->weak, __entry->direction)
+);
+
+#endif /* _KLGD_FF_TRACE_H */
+
+/* The header is not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE klgd_ff_trace
+#include <trace/define_trace.h>
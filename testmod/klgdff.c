@@ -15,6 +15,34 @@ static struct klgd_plugin *ff_plugin;
 static u16 gain;
 static u16 autocenter;
 static u32 test_user = 0xC001CAFE;
+static unsigned int update_rate;
+module_param(update_rate, uint, 0444);
+MODULE_PARM_DESC(update_rate, "Rate of recalculation of memless effects in Hz, 0 selects the default");
+static ushort tolerance = FFPL_TOLERANCE_DEFAULT;
+module_param(tolerance, ushort, 0444);
+MODULE_PARM_DESC(tolerance, "Allowed deviation of memless effects between recalculations, 0 recalculates at the update rate");
+static unsigned int output_bits;
+module_param(output_bits, uint, 0444);
+MODULE_PARM_DESC(output_bits, "Resolution of the simulated device in bits, 0 sends every change of the combined effects");
+static unsigned int budget;
+module_param(budget, uint, 0444);
+MODULE_PARM_DESC(budget, "Commands the simulated device accepts per budget window, 0 for unlimited");
+static unsigned int budget_window = 30;
+module_param(budget_window, uint, 0444);
+MODULE_PARM_DESC(budget_window, "Length of the budget window in milliseconds");
+static unsigned int device_slots;
+module_param(device_slots, uint, 0444);
+MODULE_PARM_DESC(device_slots, "Number of effect slots of the simulated device, 0 to match the number of effects");
+static bool batch;
+module_param(batch, bool, 0444);
+MODULE_PARM_DESC(batch, "Pack all commands generated in one update into a single report");
+
+#ifdef FFPL_BENCHMARK
+#define JITTER_SAMPLES 1024
+static ktime_t jitter_stamps[JITTER_SAMPLES];
+static unsigned int jitter_count;
+static bool jitter_running;
+#endif
 
 static char *klgdff_combined_rumble_dir(const u16 dir)
 {
@@ -185,7 +213,7 @@ static int klgdff_stop(struct klgd_command_stream *s, const struct ff_effect *ef
 	return klgd_append_cmd(s, c);
 }
 
-static int klgdff_update(struct klgd_command_stream *s, const struct ff_effect *effect)
+static int klgdff_update(struct klgd_command_stream *s, const struct ff_effect *effect, const u16 changed)
 {
 	char *text;
 	size_t len;
@@ -207,7 +235,7 @@ static int klgdff_update(struct klgd_command_stream *s, const struct ff_effect *
 				 effect->u.rumble.weak_magnitude, klgdff_combined_rumble_dir(effect->direction));
 		break;
 	default:
-		text = kasprintf(GFP_KERNEL, "Updating, type %d, id %d", effect->type, effect->id);
+		text = kasprintf(GFP_KERNEL, "Updating, type %d, id %d, changed 0x%X", effect->type, effect->id, changed);
 		break;
 	}
 
@@ -284,6 +312,11 @@ int klgdff_callback(void *data, const struct klgd_command_stream *s)
 			printk(KERN_NOTICE "KLGDFF-TD: User1 0x%X\n", s->commands[idx]->user.ldata[0]);
 	}
 
+#ifdef FFPL_BENCHMARK
+	/* Do not let the simulated device skew the jitter measurement */
+	if (READ_ONCE(jitter_running))
+		return 0;
+#endif
 	/* Simulate default USB polling rate of 125 Hz */
 	/*usleep_range(7500, 8500);*/
 	/* Long delay to test more complicated steps */
@@ -313,7 +346,11 @@ int klgdff_control(struct input_dev *dev, struct klgd_command_stream *s, const e
 		return klgdff_erase(s, data.effects.cur);
 		break;
 	case FFPL_SRT_TO_UDT:
-		return klgdff_update(s, data.effects.cur);
+#ifdef FFPL_BENCHMARK
+		if (READ_ONCE(jitter_running) && jitter_count < JITTER_SAMPLES)
+			jitter_stamps[jitter_count++] = ktime_get();
+#endif
+		return klgdff_update(s, data.effects.cur, data.effects.changed);
 		break;
 	/* "Uploadless/eraseless" commands */
 	case FFPL_EMP_TO_SRT:
@@ -341,6 +378,141 @@ int klgdff_control(struct input_dev *dev, struct klgd_command_stream *s, const e
 	return 0;
 }
 
+/*
+ * Simulate a device that takes several effect changes in one report.
+ * The commands of the individual transitions are joined into one command.
+ */
+static int klgdff_batch_control(struct input_dev *dev, struct klgd_command_stream *s, const struct ffpl_transition *transitions,
+				const size_t count, void *user)
+{
+	struct klgd_command_stream *tmp;
+	struct klgd_command *c;
+	size_t idx;
+	size_t len = 0;
+	char *p;
+	int ret = 0;
+
+	if (!s)
+		return -EINVAL;
+
+	tmp = klgd_alloc_stream();
+	if (!tmp)
+		return -ENOMEM;
+
+	for (idx = 0; idx < count; idx++) {
+		ret = klgdff_control(dev, tmp, transitions[idx].cmd, transitions[idx].data, user);
+		if (ret)
+			goto out;
+	}
+
+	for (idx = 0; idx < tmp->count; idx++)
+		len += strlen(tmp->commands[idx]->bytes) + 2;
+	c = klgd_alloc_cmd(len + 1);
+	if (!c) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	p = c->bytes;
+	for (idx = 0; idx < tmp->count; idx++)
+		p += sprintf(p, "%s%s", idx ? "; " : "", tmp->commands[idx]->bytes);
+	printk(KERN_NOTICE "KLGDFF-TD: Packed %lu transitions into one report\n", count);
+	ret = klgd_append_cmd(s, c);
+
+out:
+	klgd_free_stream(tmp);
+	return ret;
+}
+
+#ifdef FFPL_BENCHMARK
+static ssize_t bench_deadlines_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return ffpl_bench_deadlines(buf);
+}
+
+static ssize_t bench_directions_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return ffpl_bench_directions(buf);
+}
+
+static ssize_t bench_vectors_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return ffpl_bench_vectors(buf);
+}
+
+/*
+ * Play a slow sine effect for one second and measure the intervals
+ * between updates of the combined effect that are sent to the device.
+ */
+static ssize_t bench_jitter_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	const s64 expected = NSEC_PER_SEC / (update_rate ? update_rate : FFPL_UPDATE_RATE_DEFAULT);
+	struct ff_effect e;
+	s64 min = S64_MAX, max = 0, sum = 0, dev_sum = 0;
+	unsigned int idx;
+	int ret;
+
+	memset(&e, 0, sizeof(e));
+	e.type = FF_PERIODIC;
+	e.id = -1;
+	e.direction = 0x4000;
+	e.u.periodic.waveform = FF_SINE;
+	e.u.periodic.period = 1000;
+	e.u.periodic.magnitude = 0x4000;
+
+	ret = input_ff_upload(dev, &e, NULL);
+	if (ret)
+		return ret;
+
+	/* The expected interval holds only when recalculating at the update rate */
+	ffpl_set_tolerance(ff_plugin, 0);
+	jitter_count = 0;
+	WRITE_ONCE(jitter_running, true);
+	input_event(dev, EV_FF, e.id, 1);
+	msleep(1000);
+	input_event(dev, EV_FF, e.id, 0);
+	WRITE_ONCE(jitter_running, false);
+	input_ff_erase(dev, e.id, NULL);
+	ffpl_set_tolerance(ff_plugin, tolerance);
+
+	if (jitter_count < 2)
+		return scnprintf(buf, PAGE_SIZE, "Not enough samples: %u\n", jitter_count);
+
+	for (idx = 1; idx < jitter_count; idx++) {
+		const s64 d = ktime_to_ns(ktime_sub(jitter_stamps[idx], jitter_stamps[idx - 1]));
+
+		min = min(min, d);
+		max = max(max, d);
+		sum += d;
+		dev_sum += abs(d - expected);
+	}
+
+	return scnprintf(buf, PAGE_SIZE, "samples %u\nexpected_us %lld\nmean_us %lld\nmin_us %lld\nmax_us %lld\nmean_jitter_us %lld\n",
+			 jitter_count - 1, div_s64(expected, NSEC_PER_USEC),
+			 div_s64(div_s64(sum, jitter_count - 1), NSEC_PER_USEC),
+			 div_s64(min, NSEC_PER_USEC), div_s64(max, NSEC_PER_USEC),
+			 div_s64(div_s64(dev_sum, jitter_count - 1), NSEC_PER_USEC));
+}
+
+static struct kobj_attribute bench_deadlines_attr = __ATTR_RO(bench_deadlines);
+static struct kobj_attribute bench_directions_attr = __ATTR_RO(bench_directions);
+static struct kobj_attribute bench_vectors_attr = __ATTR_RO(bench_vectors);
+static struct kobj_attribute bench_jitter_attr = __ATTR_RO(bench_jitter);
+
+static struct attribute *klgdff_bench_attrs[] = {
+	&bench_deadlines_attr.attr,
+	&bench_directions_attr.attr,
+	&bench_vectors_attr.attr,
+	&bench_jitter_attr.attr,
+	NULL
+};
+
+static const struct attribute_group klgdff_bench_group = {
+	.name = "bench",
+	.attrs = klgdff_bench_attrs
+};
+#endif
+
 static void __exit klgdff_exit(void)
 {
 	input_unregister_device(dev);
@@ -357,6 +529,13 @@ static int __init klgdff_init(void)
 	if (!klgdff_obj)
 		return -ENOMEM;
 
+#ifdef FFPL_BENCHMARK
+	ret = sysfs_create_group(klgdff_obj, &klgdff_bench_group);
+	if (ret) {
+		printk(KERN_ERR "KLGDFF-TD: Cannot create benchmark attributes\n");
+		goto errout_klgd;
+	}
+#endif
 
 	ret = klgd_init(&klgd, NULL, klgdff_callback, 1);
 	if (ret) {
@@ -404,15 +583,36 @@ static int __init klgdff_init(void)
 			       FFPL_MEMLESS_PERIODIC |
 			       FFPL_MEMLESS_RUMBLE |
 			       FFPL_TIMING_CONDITION,
-			       klgdff_control, &test_user);
+			       update_rate,
+			       klgdff_control, batch ? klgdff_batch_control : NULL, &test_user);
 	if (ret) {
 		printk(KERN_ERR "KLGDFF-TD: Cannot init plugin\n");
 		goto errout_idev;
 	}
+	ffpl_set_tolerance(ff_plugin, tolerance);
+	if (output_bits) {
+		ret = ffpl_set_output_resolution(ff_plugin, output_bits);
+		if (ret) {
+			printk(KERN_ERR "KLGDFF-TD: Invalid output resolution\n");
+			goto errout_plugin;
+		}
+	}
+	ret = ffpl_set_command_budget(ff_plugin, budget, budget_window);
+	if (ret) {
+		printk(KERN_ERR "KLGDFF-TD: Invalid command budget\n");
+		goto errout_plugin;
+	}
+	if (device_slots) {
+		ret = ffpl_set_device_slots(ff_plugin, device_slots);
+		if (ret) {
+			printk(KERN_ERR "KLGDFF-TD: Cannot set device slots\n");
+			goto errout_plugin;
+		}
+	}
 	ret = input_register_device(dev);
 	if (ret) {
 		printk(KERN_ERR "KLGDFF-TD: Cannot register input device\n");
-		goto errout_regdev;
+		goto errout_plugin;
 	}
 	
 	ret = klgd_register_plugin(&klgd, 0, ff_plugin, true);
@@ -426,6 +626,8 @@ static int __init klgdff_init(void)
 	printk(KERN_NOTICE "KLGDFF-TD: Sample module loaded\n");
 	return 0;
 
+errout_plugin:
+	ffpl_free_plugin(ff_plugin);
 errout_regdev:
 	input_free_device(dev);
 errout_idev:
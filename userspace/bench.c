@@ -0,0 +1,369 @@
+/*
+ * Benchmark driver of the plugin core.
+ *
+ * Runs a synthetic workload against the plugin on a virtual clock and reports
+ * the host time spent in get_commands() and in handling of userspace requests.
+ * A run of N virtual seconds takes only as long as the plugin needs to process it.
+ */
+#include <linux/input.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <klgd_ff_plugin.h>
+#include <getopt.h>
+#include <time.h>
+
+#define BENCH_FLAGS_DEFAULT (FFPL_HAS_EMP_TO_SRT | FFPL_HAS_SRT_TO_EMP | FFPL_REPLACE_STARTED | \
+			     FFPL_MEMLESS_CONSTANT | FFPL_MEMLESS_PERIODIC | FFPL_MEMLESS_RAMP | \
+			     FFPL_MEMLESS_RUMBLE | FFPL_TIMING_CONDITION)
+
+struct bench_config {
+	unsigned int effects;		/* Effects userspace may upload */
+	unsigned int slots;		/* Device slots, 0 if the device has a slot for every effect */
+	unsigned int memless;		/* Concurrently playing memless effects */
+	unsigned int conditions;	/* Condition effects started and stopped periodically */
+	unsigned int updates;		/* Updates of the memless effects per second */
+	unsigned int seconds;		/* Length of the run in virtual seconds */
+	unsigned int update_rate;	/* Recalculation rate of memless effects, 0 selects the default */
+	unsigned int stall_ms;		/* Virtual time the machine stalls for halfway through the run */
+	unsigned long flags;
+	bool batch;
+	bool stats;
+};
+
+struct bench_result {
+	u64 get_commands_ns;
+	unsigned long get_commands;
+	u64 request_ns;
+	unsigned long requests;
+	unsigned long commands;
+};
+
+static struct input_dev bench_dev = { .name = "KLGDFF bench", .dev = { .name = "bench0" } };
+static struct bench_result bench_res;
+static int (*bench_get_commands_orig)(struct klgd_plugin *ctx, struct klgd_command_stream **s, const unsigned long now);
+static u32 bench_seed = 0x12345678;
+
+static u64 bench_host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static u32 bench_rand(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return bench_seed >> 8;
+}
+
+/* Driver side. Each command is turned into a short packet like a real driver would do */
+static int bench_control(struct input_dev *dev, struct klgd_command_stream *s, const enum ffpl_control_command cmd,
+			 const union ffpl_control_data data, void *user)
+{
+	struct klgd_command *c = klgd_alloc_cmd(8);
+
+	if (!c)
+		return -ENOMEM;
+
+	c->bytes[0] = cmd;
+	if (cmd < FFPL_SET_GAIN)
+		c->bytes[1] = data.effects.cur->id;
+	bench_res.commands++;
+	return klgd_append_cmd(s, c);
+}
+
+static int bench_batch_control(struct input_dev *dev, struct klgd_command_stream *s,
+			       const struct ffpl_transition *transitions, const size_t count, void *user)
+{
+	size_t idx;
+	int ret;
+
+	for (idx = 0; idx < count; idx++) {
+		ret = bench_control(dev, s, transitions[idx].cmd, transitions[idx].data, user);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int bench_get_commands(struct klgd_plugin *ctx, struct klgd_command_stream **s, const unsigned long now)
+{
+	const u64 start = bench_host_ns();
+	const int ret = bench_get_commands_orig(ctx, s, now);
+
+	bench_res.get_commands_ns += bench_host_ns() - start;
+	bench_res.get_commands++;
+	return ret;
+}
+
+static void bench_stream_done(const struct klgd_command_stream *s, void *data)
+{
+}
+
+/* Submit a request and let the request worker handle it */
+static void bench_upload(struct ff_effect *effect)
+{
+	const u64 start = bench_host_ns();
+
+	bench_dev.ff->upload(&bench_dev, effect, NULL);
+	kshim_run_work();
+	bench_res.request_ns += bench_host_ns() - start;
+	bench_res.requests++;
+}
+
+static void bench_playback(const int effect_id, const int value)
+{
+	const u64 start = bench_host_ns();
+	unsigned long flags;
+
+	spin_lock_irqsave(&bench_dev.event_lock, flags);
+	bench_dev.ff->playback(&bench_dev, effect_id, value);
+	spin_unlock_irqrestore(&bench_dev.event_lock, flags);
+	kshim_run_work();
+	bench_res.request_ns += bench_host_ns() - start;
+	bench_res.requests++;
+}
+
+/* Memless effects cycle through all types the plugin can combine */
+static void bench_make_memless(struct ff_effect *effect, const int id)
+{
+	memset(effect, 0, sizeof(struct ff_effect));
+	effect->id = id;
+	effect->direction = bench_rand() & 0xffff;
+
+	switch (id % 4) {
+	case 0:
+		effect->type = FF_CONSTANT;
+		effect->u.constant.level = (s16)bench_rand();
+		effect->u.constant.envelope.attack_length = 200;
+		effect->u.constant.envelope.attack_level = 0x1000;
+		break;
+	case 1:
+		effect->type = FF_PERIODIC;
+		effect->u.periodic.waveform = FF_SINE;
+		effect->u.periodic.period = 50 + bench_rand() % 200;
+		effect->u.periodic.magnitude = bench_rand() & 0x7fff;
+		break;
+	case 2:
+		effect->type = FF_RAMP;
+		effect->replay.length = 500 + bench_rand() % 1000;
+		effect->u.ramp.start_level = (s16)bench_rand();
+		effect->u.ramp.end_level = (s16)bench_rand();
+		break;
+	case 3:
+		effect->type = FF_RUMBLE;
+		effect->u.rumble.strong_magnitude = bench_rand() & 0xffff;
+		effect->u.rumble.weak_magnitude = bench_rand() & 0xffff;
+		break;
+	}
+}
+
+static void bench_make_condition(struct ff_effect *effect, const int id)
+{
+	memset(effect, 0, sizeof(struct ff_effect));
+	effect->id = id;
+	effect->type = FF_SPRING;
+	effect->replay.length = 100 + bench_rand() % 400;
+	effect->u.condition[0].right_saturation = 0xffff;
+	effect->u.condition[0].left_saturation = 0xffff;
+	effect->u.condition[0].right_coeff = bench_rand() & 0x7fff;
+	effect->u.condition[0].left_coeff = bench_rand() & 0x7fff;
+}
+
+static int bench_run(const struct bench_config *cfg)
+{
+	const unsigned int effect_count = max(cfg->effects, cfg->memless + cfg->conditions);
+	struct klgd_plugin *plugin;
+	struct ff_effect effect;
+	struct ffpl_stats stats;
+	unsigned long end;
+	unsigned long stall_at;
+	unsigned int updates_due = 0;
+	unsigned int idx;
+	u64 wall;
+	int ret;
+
+	input_set_capability(&bench_dev, EV_FF, FF_CONSTANT);
+	input_set_capability(&bench_dev, EV_FF, FF_PERIODIC);
+	input_set_capability(&bench_dev, EV_FF, FF_SINE);
+	input_set_capability(&bench_dev, EV_FF, FF_RAMP);
+	input_set_capability(&bench_dev, EV_FF, FF_RUMBLE);
+	input_set_capability(&bench_dev, EV_FF, FF_SPRING);
+	input_set_capability(&bench_dev, EV_FF, FF_GAIN);
+
+	ret = ffpl_init_plugin(&plugin, &bench_dev, effect_count, cfg->flags, cfg->update_rate,
+			       bench_control, cfg->batch ? bench_batch_control : NULL, NULL);
+	if (ret) {
+		fprintf(stderr, "Cannot init plugin: %d\n", ret);
+		return ret;
+	}
+	if (cfg->slots) {
+		ret = ffpl_set_device_slots(plugin, cfg->slots);
+		if (ret) {
+			fprintf(stderr, "Cannot set device slots: %d\n", ret);
+			goto out_free;
+		}
+	}
+
+	bench_get_commands_orig = plugin->get_commands;
+	plugin->get_commands = bench_get_commands;
+	ret = klgd_mock_register(plugin);
+	if (ret) {
+		fprintf(stderr, "Cannot register plugin: %d\n", ret);
+		goto out_free;
+	}
+
+	for (idx = 0; idx < cfg->memless; idx++) {
+		bench_make_memless(&effect, idx);
+		bench_upload(&effect);
+		bench_playback(idx, 1);
+	}
+	for (idx = 0; idx < cfg->conditions; idx++) {
+		bench_make_condition(&effect, cfg->memless + idx);
+		bench_upload(&effect);
+	}
+
+	wall = bench_host_ns();
+	end = jiffies + (unsigned long)cfg->seconds * HZ;
+	stall_at = cfg->stall_ms ? jiffies + (unsigned long)cfg->seconds * HZ / 2 : 0;
+	while (time_before(jiffies, end)) {
+		/* Spread the updates evenly over each second */
+		updates_due += cfg->updates;
+		while (cfg->memless && updates_due >= HZ) {
+			bench_make_memless(&effect, bench_rand() % cfg->memless);
+			bench_upload(&effect);
+			updates_due -= HZ;
+		}
+		/* Condition effects are started about every 200 ms and stop by themselves */
+		for (idx = 0; idx < cfg->conditions; idx++) {
+			if (bench_rand() % (HZ / 5) == 0)
+				bench_playback(cfg->memless + idx, 1);
+		}
+
+		klgd_mock_run(plugin, jiffies + 1, bench_stream_done, NULL);
+		/* Nothing runs while the machine stalls, trip points in the meantime are processed late */
+		if (stall_at && time_after_eq(jiffies, stall_at)) {
+			kshim_advance((s64)cfg->stall_ms * NSEC_PER_MSEC);
+			stall_at = 0;
+		}
+	}
+	wall = bench_host_ns() - wall;
+
+	printf("effects %u, slots %u, memless %u, conditions %u, updates/s %u, update rate %u Hz, %u s, flags 0x%lx%s\n",
+	       effect_count, cfg->slots, cfg->memless, cfg->conditions, cfg->updates,
+	       cfg->update_rate ? cfg->update_rate : FFPL_UPDATE_RATE_DEFAULT, cfg->seconds, cfg->flags,
+	       cfg->batch ? ", batched" : "");
+	printf("get_commands: %lu calls, %llu ns/call\n", bench_res.get_commands,
+	       bench_res.get_commands ? bench_res.get_commands_ns / bench_res.get_commands : 0);
+	printf("requests:     %lu, %llu ns/request\n", bench_res.requests,
+	       bench_res.requests ? bench_res.request_ns / bench_res.requests : 0);
+	printf("commands:     %lu, %llu commands/s\n", bench_res.commands,
+	       cfg->seconds ? (u64)bench_res.commands / cfg->seconds : 0);
+	printf("wall time:    %llu us for %u virtual s\n", wall / NSEC_PER_USEC, cfg->seconds);
+	ffpl_get_stats(plugin, &stats);
+	printf("overruns:     %lu, %u warnings\n", stats.sched_overruns, kshim_warnings);
+
+	if (cfg->stats) {
+		kshim_debugfs_show("stats", stdout);
+		kshim_debugfs_show("latency", stdout);
+	}
+
+	/* Normal playback must neither warn nor process any trip point, stops included, late */
+	if (kshim_warnings || stats.sched_overruns) {
+		fprintf(stderr, "FAIL: %u warnings, %lu scheduling overruns\n", kshim_warnings, stats.sched_overruns);
+		ret = -EINVAL;
+	}
+
+	klgd_mock_unregister(plugin);
+	input_ff_destroy(&bench_dev);
+	/* Destroy request of the plugin still needs it, free it last */
+	kfree(plugin);
+	return ret;
+
+out_free:
+	ffpl_free_plugin(plugin);
+	return ret;
+}
+
+static void bench_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -e N   effects userspace may upload (default: memless + conditions)\n"
+		"  -s N   device slots (default: one per effect)\n"
+		"  -m N   concurrently playing memless effects (default 4)\n"
+		"  -c N   condition effects started periodically (default 0)\n"
+		"  -k N   updates of memless effects per second (default 100)\n"
+		"  -t N   virtual seconds to run (default 10)\n"
+		"  -r N   recalculation rate of memless effects in Hz (default %u)\n"
+		"  -f X   plugin flags in hex (default 0x%lx)\n"
+		"  -j N   stall the virtual clock once for N ms halfway through the run\n"
+		"  -b     pass commands through the batch callback\n"
+		"  -d     print the debugfs counters at the end\n"
+		"  -v     print the kernel log, twice to include debug messages\n",
+		prog, FFPL_UPDATE_RATE_DEFAULT, (unsigned long)BENCH_FLAGS_DEFAULT);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_config cfg = {
+		.memless = 4,
+		.updates = 100,
+		.seconds = 10,
+		.flags = BENCH_FLAGS_DEFAULT,
+	};
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e:s:m:c:k:t:r:f:j:bdvh")) != -1) {
+		switch (opt) {
+		case 'e':
+			cfg.effects = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cfg.slots = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			cfg.memless = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg.conditions = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			cfg.updates = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			cfg.seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			cfg.update_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			cfg.flags = strtoul(optarg, NULL, 16);
+			break;
+		case 'j':
+			cfg.stall_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			cfg.batch = true;
+			break;
+		case 'd':
+			cfg.stats = true;
+			break;
+		case 'v':
+			kshim_verbose++;
+			break;
+		default:
+			bench_usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!cfg.memless && !cfg.conditions) {
+		fprintf(stderr, "Nothing to run\n");
+		return 1;
+	}
+
+	return bench_run(&cfg) ? 1 : 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Mock of the KLGD API used by the plugin core.
+ * Declarations follow the real KLGD header, see klgd_mock.c for the implementation.
+ */
+#ifndef KLGD_H
+#define KLGD_H
+#include "kshim.h"
+
+struct klgd_command {
+	char *bytes;
+	size_t length;
+	union {
+		u32 data;
+		u32 ldata[4];
+		u8 bytes[16];
+	} user;
+};
+
+struct klgd_command_stream {
+	const struct klgd_command **commands;
+	size_t count;
+};
+
+struct klgd_plugin {
+	struct klgd_plugin_private *private;
+	spinlock_t *plugins_lock;
+	void (*deinit)(struct klgd_plugin *ctx);
+	int (*get_commands)(struct klgd_plugin *ctx, struct klgd_command_stream **s, const unsigned long now);
+	bool (*get_update_time)(struct klgd_plugin *ctx, const unsigned long now, unsigned long *t);
+	int (*init)(struct klgd_plugin *ctx);
+};
+
+int klgd_append_cmd(struct klgd_command_stream *target, const struct klgd_command *cmd);
+struct klgd_command *klgd_alloc_cmd(const size_t length);
+struct klgd_command_stream *klgd_alloc_stream(void);
+void klgd_free_stream(struct klgd_command_stream *s);
+void klgd_lock_plugins(spinlock_t *lock);
+void klgd_unlock_plugins(spinlock_t *lock);
+void klgd_unlock_plugins_sched(spinlock_t *lock);
+
+/* Harness side of the mock */
+int klgd_mock_register(struct klgd_plugin *plugin);
+void klgd_mock_unregister(struct klgd_plugin *plugin);
+/*
+ * Let the plugin run until the given jiffy the way KLGD would.
+ * Commands the plugin emits are passed to the callback.
+ */
+void klgd_mock_run(struct klgd_plugin *plugin, const unsigned long until,
+		   void (*callback)(const struct klgd_command_stream *s, void *data), void *data);
+#endif
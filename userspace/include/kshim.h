@@ -0,0 +1,185 @@
+/*
+ * Minimal userspace replacements of the kernel facilities used by the plugin core.
+ * Only what klgd_ff_plugin.c needs is provided.
+ */
+#ifndef KSHIM_H
+#define KSHIM_H
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef long long s64;
+typedef unsigned int gfp_t;
+#define GFP_KERNEL 0u
+#define GFP_ATOMIC 1u
+
+#define BIT(n) (1UL << (n))
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b) ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define clamp(v, lo, hi) min(max(v, lo), hi)
+#define clamp_t(t, v, lo, hi) min_t(t, max_t(t, v, lo), hi)
+#define abs(x) ({ __typeof__(x) __x = (x); __x < 0 ? -__x : __x; })
+#define swap(a, b) do { __typeof__(a) __t = (a); (a) = (b); (b) = __t; } while (0)
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define DIV_ROUND_UP_ULL(n, d) DIV_ROUND_UP((unsigned long long)(n), (d))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define __user
+#define U64_MAX ULLONG_MAX
+#define U32_MAX UINT32_MAX
+#define S64_MAX LLONG_MAX
+#define READ_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+#define PAGE_SIZE 4096
+#define scnprintf(b, n, ...) ({ int __r = snprintf(b, n, __VA_ARGS__); __r >= (int)(n) ? (int)(n) - 1 : __r; })
+
+/* Kernel log goes to stderr when the harness runs with -v */
+#define KERN_ERR "<3>"
+#define KERN_WARNING "<4>"
+#define KERN_NOTICE "<5>"
+#define KERN_INFO "<6>"
+#define KERN_DEBUG "<7>"
+extern int kshim_verbose;
+#define printk(...) do { if (kshim_verbose) fprintf(stderr, __VA_ARGS__); } while (0)
+#define pr_err(...) printk(KERN_ERR __VA_ARGS__)
+#define pr_debug(...) do { if (kshim_verbose > 1) fprintf(stderr, __VA_ARGS__); } while (0)
+/* Warnings are counted so that the harness can fail on them */
+extern unsigned int kshim_warnings;
+#define WARN(cond, ...) ({ int __c = !!(cond); if (__c) { kshim_warnings++; printk(__VA_ARGS__); } __c; })
+
+#define EXPORT_SYMBOL_GPL(s)
+#define MODULE_LICENSE(s)
+#define MODULE_AUTHOR(s)
+#define MODULE_DESCRIPTION(s)
+
+void *kmalloc(size_t size, gfp_t flags);
+void *kzalloc(size_t size, gfp_t flags);
+void *kcalloc(size_t n, size_t size, gfp_t flags);
+#define kmalloc_array(n, size, flags) kcalloc(n, size, flags)
+void kfree(const void *p);
+
+/* Non-atomic bit operations, the plugin serializes access by itself */
+static inline int test_bit(long nr, const unsigned long *addr)
+{
+	return (addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+static inline void __set_bit(long nr, unsigned long *addr)
+{
+	addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+static inline void __clear_bit(long nr, unsigned long *addr)
+{
+	addr[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+static inline int __test_and_set_bit(long nr, unsigned long *addr)
+{
+	const int old = test_bit(nr, addr);
+
+	__set_bit(nr, addr);
+	return old;
+}
+static inline int __test_and_clear_bit(long nr, unsigned long *addr)
+{
+	const int old = test_bit(nr, addr);
+
+	__clear_bit(nr, addr);
+	return old;
+}
+static inline unsigned long find_next_bit(const unsigned long *addr, unsigned long size, unsigned long off)
+{
+	while (off < size) {
+		const unsigned long w = addr[off / BITS_PER_LONG] >> (off % BITS_PER_LONG);
+
+		if (w)
+			return min(off + __builtin_ctzl(w), size);
+		off = (off / BITS_PER_LONG + 1) * BITS_PER_LONG;
+	}
+	return size;
+}
+#define find_first_bit(a, s) find_next_bit(a, s, 0)
+#define for_each_set_bit(bit, addr, size) \
+	for ((bit) = find_first_bit((addr), (size)); (bit) < (size); (bit) = find_next_bit((addr), (size), (bit) + 1))
+static inline unsigned int bitmap_weight(const unsigned long *a, unsigned int n)
+{
+	unsigned int i, w = 0;
+
+	for (i = 0; i < n; i++)
+		w += test_bit(i, a);
+	return w;
+}
+static inline void bitmap_zero(unsigned long *a, unsigned int n)
+{
+	memset(a, 0, BITS_TO_LONGS(n) * sizeof(long));
+}
+static inline bool bitmap_empty(const unsigned long *a, unsigned int n)
+{
+	return find_first_bit(a, n) >= n;
+}
+static inline int fls(unsigned int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+#define ilog2(x) (fls64(x) - 1)
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+	unsigned long r = 1;
+
+	while (r < n)
+		r <<= 1;
+	return r;
+}
+static inline unsigned long int_sqrt(unsigned long x)
+{
+	unsigned long r = 0, b = 1UL << (BITS_PER_LONG - 2);
+
+	while (b > x)
+		b >>= 2;
+	while (b) {
+		if (x >= r + b) {
+			x -= r + b;
+			r = (r >> 1) + b;
+		} else
+			r >>= 1;
+		b >>= 2;
+	}
+	return r;
+}
+
+static inline u64 div_u64(u64 a, u32 b) { return a / b; }
+static inline s64 div_s64(s64 a, s32 b) { return a / b; }
+static inline u64 div64_u64(u64 a, u64 b) { return a / b; }
+static inline s64 div64_s64(s64 a, s64 b) { return a / b; }
+static inline u64 div_u64_rem(u64 a, u32 b, u32 *r) { *r = a % b; return a / b; }
+
+/* The harness is single threaded, locks only have to balance */
+typedef struct {
+	int locked;
+} spinlock_t;
+#define spin_lock_init(l) ((l)->locked = 0)
+#define spin_lock(l) ((l)->locked++)
+#define spin_unlock(l) ((l)->locked--)
+#define spin_lock_irqsave(l, f) do { (f) = 0; (l)->locked++; } while (0)
+#define spin_unlock_irqrestore(l, f) do { (void)(f); (l)->locked--; } while (0)
+#endif
@@ -0,0 +1,46 @@
+/* Virtual clock. Time moves only when the harness calls kshim_advance() */
+#ifndef KSHIM_TIME_H
+#define KSHIM_TIME_H
+#include "kshim.h"
+
+#ifndef HZ
+#define HZ 250
+#endif
+#define MSEC_PER_SEC 1000L
+#define NSEC_PER_SEC 1000000000L
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_USEC 1000L
+#define TICK_NSEC (NSEC_PER_SEC / HZ)
+
+extern unsigned long jiffies;
+extern s64 kshim_now_ns;
+void kshim_advance(const s64 ns);
+
+#define time_after(a, b) ((long)((b) - (a)) < 0)
+#define time_before(a, b) time_after(b, a)
+#define time_after_eq(a, b) ((long)((a) - (b)) >= 0)
+#define time_before_eq(a, b) time_after_eq(b, a)
+static inline unsigned long msecs_to_jiffies(unsigned int m) { return ((unsigned long)m * HZ + 999) / 1000; }
+static inline unsigned int jiffies_to_msecs(unsigned long j) { return j * 1000 / HZ; }
+static inline u64 nsecs_to_jiffies(u64 n) { return n / TICK_NSEC; }
+
+typedef s64 ktime_t;
+static inline ktime_t ktime_get(void) { return kshim_now_ns; }
+static inline u64 ktime_get_ns(void) { return kshim_now_ns; }
+#define ktime_set(s, ns) ((s64)(s) * NSEC_PER_SEC + (ns))
+#define ktime_add(a, b) ((a) + (b))
+#define ktime_sub(a, b) ((a) - (b))
+#define ktime_add_ns(a, n) ((a) + (s64)(n))
+#define ktime_add_ms(a, n) ((a) + (s64)(n) * NSEC_PER_MSEC)
+#define ktime_sub_ns(a, n) ((a) - (s64)(n))
+#define ktime_sub_ms(a, n) ((a) - (s64)(n) * NSEC_PER_MSEC)
+#define ktime_to_ns(a) ((s64)(a))
+#define ns_to_ktime(n) ((ktime_t)(n))
+#define ms_to_ktime(m) ((ktime_t)(m) * NSEC_PER_MSEC)
+#define ktime_compare(a, b) ((a) < (b) ? -1 : (a) > (b) ? 1 : 0)
+#define ktime_before(a, b) ((a) < (b))
+#define ktime_after(a, b) ((a) > (b))
+#define ktime_to_us(a) ((a) / NSEC_PER_USEC)
+#define ktime_to_ms(a) ((a) / NSEC_PER_MSEC)
+#define KTIME_MAX S64_MAX
+#endif
@@ -0,0 +1,25 @@
+/* Workqueues run only when the harness asks for it, see kshim_run_work() */
+#ifndef KSHIM_WQ_H
+#define KSHIM_WQ_H
+#include "kshim.h"
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *);
+struct work_struct {
+	work_func_t func;
+	bool pending;
+	struct work_struct *next;
+};
+struct workqueue_struct {
+	const char *name;
+	struct work_struct *head;
+};
+#define INIT_WORK(w, f) do { (w)->func = (f); (w)->pending = false; (w)->next = NULL; } while (0)
+struct workqueue_struct *create_singlethread_workqueue(const char *name);
+bool queue_work(struct workqueue_struct *wq, struct work_struct *w);
+void flush_workqueue(struct workqueue_struct *wq);
+void destroy_workqueue(struct workqueue_struct *wq);
+
+/* Run all pending work items of all workqueues */
+unsigned int kshim_run_work(void);
+#endif
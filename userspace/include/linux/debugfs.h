@@ -0,0 +1,28 @@
+#ifndef KSHIM_DEBUGFS_H
+#define KSHIM_DEBUGFS_H
+#include "seq_file.h"
+
+/*
+ * Files are kept in a flat table instead of a filesystem,
+ * the harness reads them through kshim_debugfs_show().
+ */
+struct dentry;
+struct file_operations {
+	int (*show)(struct seq_file *m, void *unused);
+	int (*write)(void *data, u64 val);
+};
+
+#define DEFINE_SHOW_ATTRIBUTE(name) \
+	static const struct file_operations name##_fops = { .show = name##_show }
+#define DEFINE_DEBUGFS_ATTRIBUTE(fops, get, set, fmt) \
+	static const struct file_operations fops = { .write = set }
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, unsigned short mode, struct dentry *parent, void *data,
+				   const struct file_operations *fops);
+#define debugfs_create_file_unsafe debugfs_create_file
+void debugfs_remove_recursive(struct dentry *dentry);
+
+/* Print a file created by the plugin, returns -ENOENT if there is no such file */
+int kshim_debugfs_show(const char *name, FILE *f);
+#endif
@@ -0,0 +1,17 @@
+#ifndef KSHIM_FIXP_H
+#define KSHIM_FIXP_H
+#include <math.h>
+#include "../kshim.h"
+
+/* Same scaling as the kernel helpers, only the benchmarks use them */
+static inline s32 fixp_sin32(int degrees)
+{
+	degrees %= 360;
+	if (degrees < 0)
+		degrees += 360;
+	return (s32)lround(sin(degrees * M_PI / 180.0) * 0x7fffffff);
+}
+#define fixp_cos32(v) fixp_sin32((v) + 90)
+#define fixp_sin16(v) (fixp_sin32(v) >> 16)
+#define fixp_cos16(v) (fixp_cos32(v) >> 16)
+#endif
@@ -0,0 +1,45 @@
+#ifndef KSHIM_LINUX_INPUT_H
+#define KSHIM_LINUX_INPUT_H
+#include "../kshim.h"
+/* Effect definitions come from the uapi header of the build host */
+#include_next <linux/input.h>
+
+struct input_dev;
+
+struct ff_device {
+	int (*upload)(struct input_dev *dev, struct ff_effect *effect, struct ff_effect *old);
+	int (*erase)(struct input_dev *dev, int effect_id);
+	int (*playback)(struct input_dev *dev, int effect_id, int value);
+	void (*set_gain)(struct input_dev *dev, u16 gain);
+	void (*set_autocenter)(struct input_dev *dev, u16 magnitude);
+	void (*destroy)(struct ff_device *);
+	void *private;
+	int max_effects;
+};
+
+struct device {
+	const char *name;
+};
+
+struct input_dev {
+	const char *name;
+	unsigned long ffbit[BITS_TO_LONGS(FF_CNT)];
+	struct ff_device *ff;
+	spinlock_t event_lock;
+	struct device dev;
+};
+
+int input_ff_create(struct input_dev *dev, unsigned int max_effects);
+void input_ff_destroy(struct input_dev *dev);
+void input_set_capability(struct input_dev *dev, unsigned int type, unsigned int code);
+static inline void input_report_ff_status(struct input_dev *dev, unsigned int code, int value)
+{
+	(void)dev;
+	(void)code;
+	(void)value;
+}
+static inline const char *dev_name(const struct device *d)
+{
+	return d->name ? d->name : "input0";
+}
+#endif
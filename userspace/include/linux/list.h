@@ -0,0 +1,38 @@
+#ifndef KSHIM_LIST_H
+#define KSHIM_LIST_H
+#include "../kshim.h"
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *l)
+{
+	l->next = l;
+	l->prev = l;
+}
+static inline void __list_add(struct list_head *n, struct list_head *p, struct list_head *nx)
+{
+	nx->prev = n;
+	n->next = nx;
+	n->prev = p;
+	p->next = n;
+}
+static inline void list_add(struct list_head *n, struct list_head *h) { __list_add(n, h, h->next); }
+static inline void list_add_tail(struct list_head *n, struct list_head *h) { __list_add(n, h->prev, h); }
+static inline void list_del_init(struct list_head *e)
+{
+	e->next->prev = e->prev;
+	e->prev->next = e->next;
+	INIT_LIST_HEAD(e);
+}
+static inline int list_empty(const struct list_head *h) { return h->next == h; }
+static inline void list_move_tail(struct list_head *e, struct list_head *h)
+{
+	list_del_init(e);
+	list_add_tail(e, h);
+}
+#define list_entry(p, t, m) container_of(p, t, m)
+#define list_first_entry(h, t, m) list_entry((h)->next, t, m)
+#define list_first_entry_or_null(h, t, m) (list_empty(h) ? NULL : list_first_entry(h, t, m))
+#endif
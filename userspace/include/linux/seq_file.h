@@ -0,0 +1,13 @@
+#ifndef KSHIM_SEQ_FILE_H
+#define KSHIM_SEQ_FILE_H
+#include "../kshim.h"
+
+/* Debugfs files are printed straight to a stdio stream */
+struct seq_file {
+	FILE *f;
+	void *private;
+};
+#define seq_printf(m, ...) fprintf((m)->f, __VA_ARGS__)
+#define seq_puts(m, s) fputs(s, (m)->f)
+#define seq_putc(m, c) fputc(c, (m)->f)
+#endif
@@ -0,0 +1 @@
+#include "../kshim_time.h"
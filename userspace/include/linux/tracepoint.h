@@ -0,0 +1,21 @@
+/*
+ * Tracepoints compile to empty functions. The event record is still
+ * filled in so that the assignments are type checked.
+ */
+#ifndef KSHIM_TRACEPOINT_H
+#define KSHIM_TRACEPOINT_H
+#define TP_PROTO(...) __VA_ARGS__
+#define TP_ARGS(...) __VA_ARGS__
+#define TP_STRUCT__entry(...) __VA_ARGS__
+#define __field(type, name) type name;
+#define TP_fast_assign(...) __VA_ARGS__
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print)			\
+	struct kshim_trace_##name { tstruct };					\
+	static inline void trace_##name(proto)					\
+	{									\
+		struct kshim_trace_##name __e, *__entry = &__e;			\
+										\
+		assign;								\
+		(void)__entry;							\
+	}
+#endif
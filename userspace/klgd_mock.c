@@ -0,0 +1,130 @@
+/*
+ * Mock of KLGD. Like the real thing it asks the plugin when it wants to be
+ * called next, sleeps until then and passes the emitted commands to the device.
+ * Sleeping is done by moving the virtual clock.
+ */
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <klgd.h>
+
+static spinlock_t klgd_mock_lock;
+static bool klgd_mock_resched;
+/* Schedule persists across klgd_mock_run() calls like the timer of KLGD does */
+static bool klgd_mock_scheduled;
+static unsigned long klgd_mock_next;
+
+/* Time the request worker takes before KLGD asks for the next update */
+#define KLGD_MOCK_WORK_NSEC (20 * NSEC_PER_USEC)
+
+struct klgd_command *klgd_alloc_cmd(const size_t length)
+{
+	struct klgd_command *cmd = kzalloc(sizeof(struct klgd_command), GFP_KERNEL);
+
+	if (!cmd)
+		return NULL;
+
+	cmd->bytes = kzalloc(length, GFP_KERNEL);
+	if (!cmd->bytes) {
+		kfree(cmd);
+		return NULL;
+	}
+	cmd->length = length;
+	return cmd;
+}
+
+struct klgd_command_stream *klgd_alloc_stream(void)
+{
+	return kzalloc(sizeof(struct klgd_command_stream), GFP_KERNEL);
+}
+
+int klgd_append_cmd(struct klgd_command_stream *target, const struct klgd_command *cmd)
+{
+	const struct klgd_command **temp;
+
+	if (!target || !cmd)
+		return -EINVAL;
+
+	temp = realloc(target->commands, sizeof(struct klgd_command *) * (target->count + 1));
+	if (!temp)
+		return -ENOMEM;
+
+	target->commands = temp;
+	target->commands[target->count++] = cmd;
+	return 0;
+}
+
+void klgd_free_stream(struct klgd_command_stream *s)
+{
+	size_t idx;
+
+	if (!s)
+		return;
+
+	for (idx = 0; idx < s->count; idx++) {
+		kfree(s->commands[idx]->bytes);
+		kfree(s->commands[idx]);
+	}
+	free(s->commands);
+	kfree(s);
+}
+
+void klgd_lock_plugins(spinlock_t *lock)
+{
+	spin_lock(lock);
+}
+
+void klgd_unlock_plugins(spinlock_t *lock)
+{
+	spin_unlock(lock);
+}
+
+void klgd_unlock_plugins_sched(spinlock_t *lock)
+{
+	spin_unlock(lock);
+	klgd_mock_resched = true;
+}
+
+int klgd_mock_register(struct klgd_plugin *plugin)
+{
+	spin_lock_init(&klgd_mock_lock);
+	plugin->plugins_lock = &klgd_mock_lock;
+	klgd_mock_resched = true;
+	klgd_mock_scheduled = false;
+	return plugin->init(plugin);
+}
+
+void klgd_mock_unregister(struct klgd_plugin *plugin)
+{
+	plugin->deinit(plugin);
+}
+
+void klgd_mock_run(struct klgd_plugin *plugin, const unsigned long until,
+		   void (*callback)(const struct klgd_command_stream *s, void *data), void *data)
+{
+	while (time_before(jiffies, until)) {
+		if (kshim_run_work())
+			kshim_advance(KLGD_MOCK_WORK_NSEC);
+		if (klgd_mock_resched) {
+			klgd_lock_plugins(plugin->plugins_lock);
+			klgd_mock_scheduled = plugin->get_update_time(plugin, jiffies, &klgd_mock_next);
+			klgd_unlock_plugins(plugin->plugins_lock);
+			klgd_mock_resched = false;
+		}
+
+		if (klgd_mock_scheduled && time_before_eq(klgd_mock_next, jiffies)) {
+			struct klgd_command_stream *s = NULL;
+
+			klgd_lock_plugins(plugin->plugins_lock);
+			if (!plugin->get_commands(plugin, &s, jiffies) && s)
+				callback(s, data);
+			klgd_mock_scheduled = plugin->get_update_time(plugin, jiffies, &klgd_mock_next);
+			klgd_unlock_plugins(plugin->plugins_lock);
+			klgd_free_stream(s);
+			/* Work queued by get_commands() has to run before the next update */
+			continue;
+		}
+
+		/* Timers of KLGD fire at jiffy boundaries */
+		kshim_advance(TICK_NSEC - kshim_now_ns % TICK_NSEC);
+	}
+}
@@ -0,0 +1,225 @@
+/*
+ * Userspace implementation of the kernel facilities declared in include/.
+ * Everything runs in the thread of the harness.
+ */
+#include <linux/input.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+
+int kshim_verbose;
+unsigned int kshim_warnings;
+unsigned long jiffies;
+s64 kshim_now_ns;
+
+void *kmalloc(size_t size, gfp_t flags)
+{
+	(void)flags;
+	return malloc(size);
+}
+
+void *kzalloc(size_t size, gfp_t flags)
+{
+	(void)flags;
+	return calloc(1, size);
+}
+
+void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+	(void)flags;
+	return calloc(n, size);
+}
+
+void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+void kshim_advance(const s64 ns)
+{
+	kshim_now_ns += ns;
+	jiffies = kshim_now_ns / TICK_NSEC;
+}
+
+/* Workqueues */
+#define KSHIM_MAX_WQ 8
+static struct workqueue_struct *kshim_wqs[KSHIM_MAX_WQ];
+
+struct workqueue_struct *create_singlethread_workqueue(const char *name)
+{
+	size_t idx;
+
+	for (idx = 0; idx < KSHIM_MAX_WQ; idx++) {
+		if (!kshim_wqs[idx]) {
+			kshim_wqs[idx] = kzalloc(sizeof(struct workqueue_struct), GFP_KERNEL);
+			if (kshim_wqs[idx])
+				kshim_wqs[idx]->name = name;
+			return kshim_wqs[idx];
+		}
+	}
+	return NULL;
+}
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *w)
+{
+	struct work_struct **tail;
+
+	if (w->pending)
+		return false;
+
+	for (tail = &wq->head; *tail; tail = &(*tail)->next);
+	w->pending = true;
+	w->next = NULL;
+	*tail = w;
+	return true;
+}
+
+static unsigned int kshim_run_wq(struct workqueue_struct *wq)
+{
+	unsigned int done = 0;
+
+	while (wq->head) {
+		struct work_struct *w = wq->head;
+
+		wq->head = w->next;
+		w->pending = false;
+		w->func(w);
+		done++;
+	}
+	return done;
+}
+
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	kshim_run_wq(wq);
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	size_t idx;
+
+	kshim_run_wq(wq);
+	for (idx = 0; idx < KSHIM_MAX_WQ; idx++) {
+		if (kshim_wqs[idx] == wq)
+			kshim_wqs[idx] = NULL;
+	}
+	kfree(wq);
+}
+
+unsigned int kshim_run_work(void)
+{
+	unsigned int done = 0;
+	size_t idx;
+
+	for (idx = 0; idx < KSHIM_MAX_WQ; idx++) {
+		if (kshim_wqs[idx])
+			done += kshim_run_wq(kshim_wqs[idx]);
+	}
+	return done;
+}
+
+/* Input device */
+int input_ff_create(struct input_dev *dev, unsigned int max_effects)
+{
+	dev->ff = kzalloc(sizeof(struct ff_device), GFP_KERNEL);
+	if (!dev->ff)
+		return -ENOMEM;
+
+	dev->ff->max_effects = max_effects;
+	return 0;
+}
+
+void input_ff_destroy(struct input_dev *dev)
+{
+	if (!dev->ff)
+		return;
+
+	if (dev->ff->destroy)
+		dev->ff->destroy(dev->ff);
+	kfree(dev->ff);
+	dev->ff = NULL;
+}
+
+void input_set_capability(struct input_dev *dev, unsigned int type, unsigned int code)
+{
+	if (type == EV_FF)
+		__set_bit(code, dev->ffbit);
+}
+
+/* Debugfs */
+#define KSHIM_MAX_FILES 16
+struct dentry {
+	char name[64];
+	struct dentry *parent;
+	void *data;
+	const struct file_operations *fops;
+};
+static struct dentry *kshim_files[KSHIM_MAX_FILES];
+
+static struct dentry *kshim_add_dentry(const char *name, struct dentry *parent, void *data,
+				       const struct file_operations *fops)
+{
+	size_t idx;
+
+	for (idx = 0; idx < KSHIM_MAX_FILES; idx++) {
+		if (!kshim_files[idx]) {
+			struct dentry *d = kzalloc(sizeof(struct dentry), GFP_KERNEL);
+
+			if (!d)
+				return NULL;
+			snprintf(d->name, sizeof(d->name), "%s", name);
+			d->parent = parent;
+			d->data = data;
+			d->fops = fops;
+			kshim_files[idx] = d;
+			return d;
+		}
+	}
+	return NULL;
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+	return kshim_add_dentry(name, parent, NULL, NULL);
+}
+
+struct dentry *debugfs_create_file(const char *name, unsigned short mode, struct dentry *parent, void *data,
+				   const struct file_operations *fops)
+{
+	(void)mode;
+	return kshim_add_dentry(name, parent, data, fops);
+}
+
+void debugfs_remove_recursive(struct dentry *dentry)
+{
+	size_t idx;
+
+	if (!dentry)
+		return;
+
+	for (idx = 0; idx < KSHIM_MAX_FILES; idx++) {
+		if (kshim_files[idx] && kshim_files[idx]->parent == dentry)
+			debugfs_remove_recursive(kshim_files[idx]);
+	}
+	for (idx = 0; idx < KSHIM_MAX_FILES; idx++) {
+		if (kshim_files[idx] == dentry)
+			kshim_files[idx] = NULL;
+	}
+	kfree(dentry);
+}
+
+int kshim_debugfs_show(const char *name, FILE *f)
+{
+	size_t idx;
+
+	for (idx = 0; idx < KSHIM_MAX_FILES; idx++) {
+		struct dentry *d = kshim_files[idx];
+
+		if (d && d->fops && d->fops->show && !strcmp(d->name, name)) {
+			struct seq_file m = { .f = f, .private = d->data };
+
+			return d->fops->show(&m, NULL);
+		}
+	}
+	return -ENOENT;
+}
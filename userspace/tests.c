@@ -0,0 +1,332 @@
+/*
+ * Regression tests of the plugin core.
+ *
+ * Each test drives a fresh plugin through the KLGD mock on the virtual clock
+ * and checks the commands that reach the device.
+ */
+#include <linux/input.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <klgd_ff_plugin.h>
+
+#define TEST_FLAGS_MEMLESS (FFPL_HAS_EMP_TO_SRT | FFPL_HAS_SRT_TO_EMP | FFPL_REPLACE_STARTED | \
+			    FFPL_MEMLESS_CONSTANT | FFPL_MEMLESS_PERIODIC)
+#define TEST_FLAGS_TIMED (TEST_FLAGS_MEMLESS | FFPL_TIMING_CONDITION)
+#define TEST_LOG_SIZE 4096
+
+/* Command as the device has seen it */
+struct test_cmd {
+	enum ffpl_control_command cmd;
+	int id;
+	int type;
+	s32 level;	/* Level of constant force effects */
+	ktime_t at;
+};
+
+struct test_case {
+	const char *name;
+	int (*run)(void);
+};
+
+static struct input_dev test_dev;
+static struct klgd_plugin *test_plugin;
+static struct test_cmd test_log[TEST_LOG_SIZE];
+static size_t test_log_count;
+
+static int test_control(struct input_dev *dev, struct klgd_command_stream *s, const enum ffpl_control_command cmd,
+			const union ffpl_control_data data, void *user)
+{
+	struct klgd_command *c = klgd_alloc_cmd(1);
+
+	if (!c)
+		return -ENOMEM;
+
+	if (test_log_count < TEST_LOG_SIZE) {
+		struct test_cmd *t = &test_log[test_log_count++];
+
+		t->cmd = cmd;
+		t->at = ktime_get();
+		if (cmd < FFPL_SET_GAIN) {
+			t->id = data.effects.cur->id;
+			t->type = data.effects.cur->type;
+			if (t->type == FF_CONSTANT)
+				t->level = data.effects.cur->u.constant.level;
+		}
+	}
+	c->bytes[0] = cmd;
+	return klgd_append_cmd(s, c);
+}
+
+static void test_stream_done(const struct klgd_command_stream *s, void *data)
+{
+}
+
+static int test_setup(const unsigned long flags)
+{
+	int ret;
+
+	memset(&test_dev, 0, sizeof(test_dev));
+	test_dev.name = "KLGDFF test";
+	test_dev.dev.name = "test0";
+	input_set_capability(&test_dev, EV_FF, FF_CONSTANT);
+	input_set_capability(&test_dev, EV_FF, FF_PERIODIC);
+	input_set_capability(&test_dev, EV_FF, FF_SINE);
+	input_set_capability(&test_dev, EV_FF, FF_SPRING);
+	input_set_capability(&test_dev, EV_FF, FF_GAIN);
+	test_log_count = 0;
+
+	ret = ffpl_init_plugin(&test_plugin, &test_dev, 4, flags, 0, test_control, NULL, NULL);
+	if (ret)
+		return ret;
+
+	ret = klgd_mock_register(test_plugin);
+	if (ret)
+		ffpl_free_plugin(test_plugin);
+	return ret;
+}
+
+static void test_teardown(void)
+{
+	klgd_mock_unregister(test_plugin);
+	input_ff_destroy(&test_dev);
+	/* Destroy request of the plugin still needs it, free it last */
+	kfree(test_plugin);
+}
+
+static void test_upload(struct ff_effect *effect)
+{
+	test_dev.ff->upload(&test_dev, effect, NULL);
+}
+
+static void test_playback(const int effect_id, const int value)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&test_dev.event_lock, flags);
+	test_dev.ff->playback(&test_dev, effect_id, value);
+	spin_unlock_irqrestore(&test_dev.event_lock, flags);
+}
+
+static void test_set_gain(const u16 gain)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&test_dev.event_lock, flags);
+	test_dev.ff->set_gain(&test_dev, gain);
+	spin_unlock_irqrestore(&test_dev.event_lock, flags);
+}
+
+static void test_run_ms(const unsigned int ms)
+{
+	klgd_mock_run(test_plugin, jiffies + msecs_to_jiffies(ms), test_stream_done, NULL);
+}
+
+/* Largest level of the combined constant force sent since the given time */
+static s32 test_max_level(const ktime_t since)
+{
+	s32 level = 0;
+	size_t idx;
+
+	for (idx = 0; idx < test_log_count; idx++) {
+		const struct test_cmd *t = &test_log[idx];
+
+		if (t->cmd < FFPL_SET_GAIN && t->type == FF_CONSTANT && !ktime_before(t->at, since))
+			level = max(level, abs(t->level));
+	}
+	return level;
+}
+
+/* Time of the first command of an effect since the given time, 0 if there is none */
+static ktime_t test_find_cmd(const int id, const enum ffpl_control_command cmd, const ktime_t since)
+{
+	size_t idx;
+
+	for (idx = 0; idx < test_log_count; idx++) {
+		const struct test_cmd *t = &test_log[idx];
+
+		if (t->cmd == cmd && t->id == id && !ktime_before(t->at, since))
+			return t->at;
+	}
+	return 0;
+}
+
+/* Starts and stops are never sent before their trip points, and at most a tick after them */
+static int test_start_stop_timing(void)
+{
+	struct ff_effect effect = { .type = FF_SPRING, .id = 0 };
+	ktime_t t0, started, stopped;
+	int ret;
+
+	ret = test_setup(TEST_FLAGS_TIMED);
+	if (ret)
+		return ret;
+
+	/* Requests late in a tick make KLGD wake us up before the trip points */
+	kshim_advance((TICK_NSEC * 9 / 10 - kshim_now_ns % TICK_NSEC + TICK_NSEC) % TICK_NSEC);
+	effect.replay.delay = 10;
+	effect.replay.length = 50;
+	effect.u.condition[0].right_saturation = 0xffff;
+	effect.u.condition[0].left_saturation = 0xffff;
+	effect.u.condition[0].right_coeff = 0x4000;
+	t0 = ktime_get();
+	test_upload(&effect);
+	test_playback(0, 1);
+	test_run_ms(100);
+
+	started = test_find_cmd(0, FFPL_EMP_TO_SRT, t0);
+	stopped = test_find_cmd(0, FFPL_SRT_TO_UPL, t0);
+	test_teardown();
+	if (!started || ktime_before(started, ktime_add_ms(t0, 10)) ||
+	    ktime_after(started, ktime_add_ns(ktime_add_ms(t0, 10), TICK_NSEC))) {
+		fprintf(stderr, "started %lld ns after the request, expected 10 ms\n", ktime_to_ns(ktime_sub(started, t0)));
+		return -EINVAL;
+	}
+	if (!stopped || ktime_before(stopped, ktime_add_ms(t0, 60)) ||
+	    ktime_after(stopped, ktime_add_ns(ktime_add_ms(t0, 60), TICK_NSEC))) {
+		fprintf(stderr, "stopped %lld ns after the request, expected 60 ms\n", ktime_to_ns(ktime_sub(stopped, t0)));
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* Number of commands of an effect sent since the given time */
+static unsigned int test_count_cmds(const int id, const enum ffpl_control_command cmd, const ktime_t since)
+{
+	unsigned int count = 0;
+	size_t idx;
+
+	for (idx = 0; idx < test_log_count; idx++) {
+		const struct test_cmd *t = &test_log[idx];
+
+		if (t->cmd == cmd && t->id == id && !ktime_before(t->at, since))
+			count++;
+	}
+	return count;
+}
+
+/* A stop processed long after its trip point is one overrun, however often KLGD asks for the update time */
+static int test_late_stop_overrun(void)
+{
+	struct ff_effect effect = { .type = FF_SPRING, .id = 0 };
+	struct ffpl_stats stats;
+	unsigned long next;
+	unsigned int stops;
+	int ret;
+	int i;
+
+	ret = test_setup(TEST_FLAGS_TIMED);
+	if (ret)
+		return ret;
+
+	effect.replay.length = 50;
+	effect.u.condition[0].right_saturation = 0xffff;
+	effect.u.condition[0].left_saturation = 0xffff;
+	effect.u.condition[0].right_coeff = 0x4000;
+	test_upload(&effect);
+	test_playback(0, 1);
+	test_run_ms(20);
+
+	/* The machine was busy for a while */
+	kshim_advance(200 * NSEC_PER_MSEC);
+	for (i = 0; i < 3; i++) {
+		klgd_lock_plugins(test_plugin->plugins_lock);
+		test_plugin->get_update_time(test_plugin, jiffies, &next);
+		klgd_unlock_plugins(test_plugin->plugins_lock);
+	}
+	test_run_ms(20);
+
+	stops = test_count_cmds(0, FFPL_SRT_TO_UPL, 0);
+	ffpl_get_stats(test_plugin, &stats);
+	test_teardown();
+	if (stops != 1 || stats.sched_overruns != 1) {
+		fprintf(stderr, "%u stops and %lu overruns, expected one of each\n", stops, stats.sched_overruns);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* Infinite effects keep the level reached by the attack, also after the gain is changed */
+static int test_infinite_attack(void)
+{
+	struct ff_effect effect = { .type = FF_CONSTANT, .id = 0, .direction = 0x4000 };
+	s32 level;
+	int ret;
+
+	ret = test_setup(TEST_FLAGS_MEMLESS);
+	if (ret)
+		return ret;
+
+	effect.u.constant.level = 10000;
+	effect.u.constant.envelope.attack_length = 100;
+	test_upload(&effect);
+	test_playback(0, 1);
+	test_run_ms(300);
+	test_set_gain(0xffff);
+	test_run_ms(700);
+
+	level = test_max_level(0);
+	test_teardown();
+	if (level > 10001) {
+		fprintf(stderr, "constant level %d, expected at most 10001\n", level);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int test_infinite_attack_periodic(void)
+{
+	struct ff_effect effect = { .type = FF_PERIODIC, .id = 0, .direction = 0x4000 };
+	s32 level;
+	int ret;
+
+	ret = test_setup(TEST_FLAGS_MEMLESS);
+	if (ret)
+		return ret;
+
+	effect.u.periodic.waveform = FF_SINE;
+	effect.u.periodic.period = 100;
+	effect.u.periodic.magnitude = 5000;
+	effect.u.periodic.envelope.attack_length = 100;
+	test_upload(&effect);
+	test_playback(0, 1);
+	test_run_ms(1000);
+
+	level = test_max_level(0);
+	test_teardown();
+	if (level > 5001) {
+		fprintf(stderr, "sine level %d, expected at most 5001\n", level);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static const struct test_case test_cases[] = {
+	{ "infinite_attack", test_infinite_attack },
+	{ "infinite_attack_periodic", test_infinite_attack_periodic },
+	{ "start_stop_timing", test_start_stop_timing },
+	{ "late_stop_overrun", test_late_stop_overrun },
+};
+
+int main(int argc, char **argv)
+{
+	unsigned int failed = 0;
+	size_t idx;
+
+	if (argc > 1 && !strcmp(argv[1], "-v"))
+		kshim_verbose++;
+
+	for (idx = 0; idx < ARRAY_SIZE(test_cases); idx++) {
+		const unsigned int warnings = kshim_warnings;
+		int ret = test_cases[idx].run();
+
+		if (!ret && kshim_warnings != warnings) {
+			fprintf(stderr, "%u warnings\n", kshim_warnings - warnings);
+			ret = -EINVAL;
+		}
+		printf("%-32s %s\n", test_cases[idx].name, ret ? "FAIL" : "ok");
+		if (ret)
+			failed++;
+	}
+
+	return failed ? 1 : 0;
+}